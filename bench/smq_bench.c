@@ -0,0 +1,465 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** Throughput and latency benchmark for SMQ and vSMQ.
+**
+** Sweeps producer/consumer thread counts, payload sizes, bounded vs.
+** unbounded queues and blocking vs. non-blocking timeouts. Every run
+** prints one line of CSV (default) or JSON so results may be kept and
+** compared over time.
+**
+** Build: make bench
+** Usage: build/smq_bench [options]
+**
+**  -q smq,smqfc,smqpoll,smqpre,vsmq
+**                  queue types to run (smqfc: smq_create_combining(),
+**                  smqpoll: smq_set_busy_poll(), smqpre:
+**                  smq_create_prealloc() with prefaulted huge pages;
+**                  bounded runs only)
+**  -a 2,3          pin consumer i to the i'th CPU in the list (mod its
+**                  length); Linux only
+**  -p 1,2,4        producer thread counts
+**  -c 1,2,4        consumer thread counts
+**  -s 8,64,1024    payload sizes in bytes (minimum 8)
+**  -m 0,1024       max_count values (0 is unbounded)
+**  -w -1,0         timeout_ms for send/recv (-1 blocks, 0 polls)
+**  -n 200000       messages per run
+**  -j              JSON lines instead of CSV
+**
+** Each payload carries the CLOCK_MONOTONIC time it was sent in its first
+** 8 bytes; latency is measured from that stamp to the moment a consumer
+** has the message in hand. CPU per message is the user+system time of
+** the whole process during the run divided by the number of messages.
+** empty_polls is smq_get_empty_polls() for the run (busy-poll only).
+*/
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "vsmq.h"
+
+#define BENCH_MAX_LIST  16
+#define BENCH_MIN_SIZE  ((int)sizeof(uint64_t))
+
+/*
+** A stamp of 0 is never a valid send time; consumers exit when they
+** see it.
+*/
+#define BENCH_STOP      0
+
+enum { BENCH_SMQ, BENCH_SMQ_FC, BENCH_SMQ_POLL, BENCH_SMQ_PRE, BENCH_VSMQ };
+
+static const char *bench_names[] = { "smq", "smqfc", "smqpoll", "smqpre", "vsmq" };
+
+typedef struct st_bench_list {
+    int n;
+    int v[BENCH_MAX_LIST];
+} BenchList;
+
+typedef struct st_bench_run {
+    int type;
+    int producers;
+    int consumers;
+    int size;
+    int max_count;
+    int timeout_ms;
+    long messages;
+
+    /* CPUs to pin consumers to; an empty list for none */
+    BenchList *cpus;
+
+    SMQ q;
+} BenchRun;
+
+typedef struct st_bench_thread {
+    BenchRun *run;
+    pthread_t tid;
+    long count;
+    int cpu;
+
+    /* latency samples (consumers only) */
+    uint64_t *lat;
+    long nlat;
+} BenchThread;
+
+/*
+** now_ns()
+**
+** Current CLOCK_MONOTONIC time in nanoseconds.
+*/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+** cpu_ns()
+**
+** User plus system CPU time consumed by the process in nanoseconds.
+*/
+static uint64_t cpu_ns(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL +
+        ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/*
+** parse_list()
+**
+** Parse a comma separated list of integers into ``list''.
+*/
+static int parse_list(BenchList *list, const char *arg) {
+    char *end;
+
+    list->n = 0;
+    while (*arg && list->n < BENCH_MAX_LIST) {
+        list->v[list->n++] = (int)strtol(arg, &end, 10);
+        if (end == arg)
+            return -1;
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return list->n > 0 ? 0 : -1;
+}
+
+/*
+** parse_types()
+**
+** Parse a comma separated list of queue type names.
+*/
+static int parse_types(int *types, const char *arg) {
+    int n = 0, t;
+    size_t len;
+
+    while (*arg && n < BENCH_VSMQ + 1) {
+        len = strcspn(arg, ",");
+        for (t = 0; t <= BENCH_VSMQ; t++) {
+            if (strlen(bench_names[t]) == len && !strncmp(arg, bench_names[t], len))
+                break;
+        }
+        if (t > BENCH_VSMQ)
+            return -1;
+        types[n++] = t;
+        arg += len;
+        if (*arg == ',')
+            arg++;
+    }
+    return n;
+}
+
+/*
+** bench_send()
+**
+** Send a single payload, honouring the timeout semantics for the run.
+** With a timeout of 0 we retry (yielding) until the write succeeds so
+** the same number of messages is always delivered.
+*/
+static void bench_send(BenchRun *run, void *buf) {
+    for (;;) {
+        int rc;
+
+        if (run->type == BENCH_VSMQ)
+            rc = vsmq_send(run->q, buf, run->size, run->timeout_ms);
+        else
+            rc = smq_send(run->q, buf, run->timeout_ms);
+        if (rc == 0)
+            return;
+        sched_yield();
+    }
+}
+
+/*
+** bench_recv()
+**
+** Receive a single payload into ``buf'' and return its send stamp. A
+** timeout of 0 polls (yielding) until a message is available.
+*/
+static uint64_t bench_recv(BenchRun *run, void *buf) {
+    uint64_t stamp;
+
+    for (;;) {
+        if (run->type == BENCH_VSMQ) {
+            void *p;
+
+            if ((p = vsmq_recv(run->q, NULL, run->timeout_ms))) {
+                memcpy(&stamp, p, sizeof(stamp));
+                free (p);
+                return stamp;
+            }
+        } else if (smq_recv(run->q, buf, NULL, run->timeout_ms)) {
+            memcpy(&stamp, buf, sizeof(stamp));
+            return stamp;
+        }
+        sched_yield();
+    }
+}
+
+static void *bench_producer(void *arg) {
+    BenchThread *t = arg;
+    BenchRun *run = t->run;
+    char *buf;
+    uint64_t stamp;
+    long i;
+
+    if (!(buf = calloc(1, run->size)))
+        return NULL;
+
+    for (i = 0; i < t->count; i++) {
+        stamp = now_ns();
+        memcpy(buf, &stamp, sizeof(stamp));
+        bench_send(run, buf);
+    }
+
+    free (buf);
+    return NULL;
+}
+
+/*
+** bench_pin()
+**
+** Pin the calling thread to ``cpu'' (-1 for none).
+*/
+static void bench_pin(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+static void *bench_consumer(void *arg) {
+    BenchThread *t = arg;
+    BenchRun *run = t->run;
+    char *buf;
+    uint64_t stamp;
+
+    bench_pin(t->cpu);
+
+    if (!(buf = calloc(1, run->size)))
+        return NULL;
+
+    while ((stamp = bench_recv(run, buf)) != BENCH_STOP) {
+        uint64_t now = now_ns();
+
+        t->lat[t->nlat++] = now > stamp ? now - stamp : 0;
+    }
+
+    free (buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *v, long n, double pct) {
+    long idx;
+
+    if (n <= 0)
+        return 0;
+    idx = (long)((pct / 100.0) * (double)(n - 1));
+    return v[idx];
+}
+
+/*
+** bench_run()
+**
+** Execute a single configuration and print one result line.
+*/
+static int bench_run(BenchRun *run, int json) {
+    BenchThread *prod, *cons;
+    uint64_t t0, t1, c0, c1, *all;
+    char *stop;
+    long i, j, nall = 0;
+    double secs;
+
+    if (run->type == BENCH_VSMQ)
+        run->q = vsmq_create(run->max_count);
+    else if (run->type == BENCH_SMQ_FC)
+        run->q = smq_create_combining(run->size, run->max_count, NULL);
+    else if (run->type == BENCH_SMQ_PRE) {
+        /* preallocation is sized by max_count; nothing to run unbounded */
+        if (run->max_count <= 0)
+            return 0;
+        run->q = smq_create_prealloc(run->size, run->max_count, NULL,
+            SMQ_PREALLOC_HUGETLB | SMQ_PREALLOC_PREFAULT, -1);
+    } else
+        run->q = smq_create(run->size, run->max_count, NULL);
+    if (!run->q)
+        return -1;
+    if (run->type == BENCH_SMQ_POLL)
+        smq_set_busy_poll(run->q, 1);
+
+    prod = calloc(run->producers, sizeof(*prod));
+    cons = calloc(run->consumers, sizeof(*cons));
+    stop = calloc(1, run->size);
+    if (!prod || !cons || !stop)
+        return -1;
+
+    for (i = 0; i < run->consumers; i++) {
+        cons[i].run = run;
+        cons[i].cpu = run->cpus->n ? run->cpus->v[i % run->cpus->n] : -1;
+        if (!(cons[i].lat = malloc(sizeof(uint64_t) * run->messages)))
+            return -1;
+    }
+
+    t0 = now_ns();
+    c0 = cpu_ns();
+
+    for (i = 0; i < run->consumers; i++)
+        pthread_create(&cons[i].tid, NULL, bench_consumer, &cons[i]);
+    for (i = 0; i < run->producers; i++) {
+        prod[i].run = run;
+        prod[i].count = run->messages / run->producers +
+            (i < run->messages % run->producers ? 1 : 0);
+        pthread_create(&prod[i].tid, NULL, bench_producer, &prod[i]);
+    }
+
+    for (i = 0; i < run->producers; i++)
+        pthread_join(prod[i].tid, NULL);
+
+    /* one stop marker per consumer, queued behind all real messages */
+    for (i = 0; i < run->consumers; i++)
+        bench_send(run, stop);
+    for (i = 0; i < run->consumers; i++)
+        pthread_join(cons[i].tid, NULL);
+
+    t1 = now_ns();
+    c1 = cpu_ns();
+
+    /* gather latencies */
+    if (!(all = malloc(sizeof(uint64_t) * (run->messages + 1))))
+        return -1;
+    for (i = 0; i < run->consumers; i++) {
+        for (j = 0; j < cons[i].nlat; j++)
+            all[nall++] = cons[i].lat[j];
+        free (cons[i].lat);
+    }
+    qsort(all, nall, sizeof(*all), cmp_u64);
+
+    secs = (double)(t1 - t0) / 1e9;
+
+    printf(json ?
+        "{\"queue\":\"%s\",\"producers\":%d,\"consumers\":%d,\"size\":%d,"
+        "\"max_count\":%d,\"timeout_ms\":%d,\"messages\":%ld,\"seconds\":%.6f,"
+        "\"msgs_per_sec\":%.0f,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,"
+        "\"p999_ns\":%llu,\"max_ns\":%llu,\"cpu_ns_per_msg\":%.1f,\"empty_polls\":%llu}\n" :
+        "%s,%d,%d,%d,%d,%d,%ld,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%.1f,%llu\n",
+        bench_names[run->type],
+        run->producers, run->consumers, run->size, run->max_count,
+        run->timeout_ms, nall, secs, (double)nall / secs,
+        (unsigned long long)percentile(all, nall, 50.0),
+        (unsigned long long)percentile(all, nall, 90.0),
+        (unsigned long long)percentile(all, nall, 99.0),
+        (unsigned long long)percentile(all, nall, 99.9),
+        (unsigned long long)(nall ? all[nall - 1] : 0),
+        nall ? (double)(c1 - c0) / (double)nall : 0.0,
+        smq_get_empty_polls(run->q));
+    fflush(stdout);
+
+    free (all);
+    free (stop);
+    free (prod);
+    free (cons);
+    smq_destroy(run->q);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-q smq,smqfc,smqpoll,smqpre,vsmq] [-p list] [-c list] [-s list]\n"
+        "          [-m list] [-w list] [-a cpus] [-n messages] [-j]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    BenchList producers = { 2, { 1, 4 } };
+    BenchList consumers = { 2, { 1, 4 } };
+    BenchList sizes = { 3, { 8, 64, 1024 } };
+    BenchList maxes = { 2, { 0, 1024 } };
+    BenchList timeouts = { 2, { -1, 0 } };
+    BenchList cpus = { 0, { 0 } };
+    int types[BENCH_VSMQ + 1] = { BENCH_SMQ, BENCH_VSMQ }, ntypes = 2;
+    long messages = 200000;
+    int json = 0, opt, a, b, c, d, e, f;
+
+    while ((opt = getopt(argc, argv, "q:p:c:s:m:w:a:n:jh")) != -1) {
+        BenchList *list = NULL;
+
+        switch (opt) {
+            case 'q':
+                if ((ntypes = parse_types(types, optarg)) <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p': list = &producers; break;
+            case 'c': list = &consumers; break;
+            case 's': list = &sizes; break;
+            case 'm': list = &maxes; break;
+            case 'w': list = &timeouts; break;
+            case 'a': list = &cpus; break;
+            case 'n': messages = atol(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+        if (list && parse_list(list, optarg) < 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (messages <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!json)
+        puts("queue,producers,consumers,size,max_count,timeout_ms,messages,seconds,"
+            "msgs_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,cpu_ns_per_msg,empty_polls");
+
+    for (a = 0; a < ntypes; a++)
+    for (b = 0; b < producers.n; b++)
+    for (c = 0; c < consumers.n; c++)
+    for (d = 0; d < sizes.n; d++)
+    for (e = 0; e < maxes.n; e++)
+    for (f = 0; f < timeouts.n; f++) {
+        BenchRun run;
+
+        memset(&run, 0, sizeof(run));
+        run.type = types[a];
+        run.producers = producers.v[b] > 0 ? producers.v[b] : 1;
+        run.consumers = consumers.v[c] > 0 ? consumers.v[c] : 1;
+        run.size = sizes.v[d] < BENCH_MIN_SIZE ? BENCH_MIN_SIZE : sizes.v[d];
+        run.max_count = maxes.v[e];
+        run.timeout_ms = timeouts.v[f];
+        run.messages = messages;
+        run.cpus = &cpus;
+
+        if (bench_run(&run, json) < 0) {
+            fprintf(stderr, "benchmark run failed\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example sends the numbers 0 through MAXVALUE once into a
+** broadcast queue. Each of the SUBSCRIBERS threads receives every
+** number and prints a sum at the end.
+**
+** Compile: gcc smq.c smq_bcast.c smq_bcast_example1.c -pthread -o smq_bcast_example1
+*/
+#include "smq_bcast.h"
+
+#define MAXVALUE    1000
+#define SUBSCRIBERS 4
+
+void *mysubscriber(void *_sub) {
+    SMQBSub sub = _sub;
+    int value;
+    long sum = 0, n = 0;
+
+    /* -1 is our end marker */
+    while ((smq_bcast_recv(sub, &value, NULL, 1000)) > 0 && value >= 0) {
+        sum += value;
+        n++;
+    }
+
+    printf("subscriber %p: %ld messages, sum %ld\n", (void *)sub, n, sum);
+    return NULL;
+}
+
+int main(void) {
+    SMQB b;
+    SMQBSub subs[SUBSCRIBERS];
+    pthread_t tids[SUBSCRIBERS];
+    int i;
+
+    /* a small ring, so the senders wait on the slowest subscriber */
+    if (!(b = smq_bcast_create(sizeof(int), 16, SMQ_BCAST_WAIT))) {
+        fprintf(stderr, "Cannot create broadcast queue\n");
+        return -1;
+    }
+
+    /* subscribe before sending so nobody misses anything */
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        subs[i] = smq_bcast_subscribe(b);
+        pthread_create(&tids[i], NULL, mysubscriber, subs[i]);
+    }
+
+    for (i = 0; i <= MAXVALUE; i++)
+        smq_bcast_send(b, &i, -1);
+
+    i = -1;
+    smq_bcast_send(b, &i, -1);
+
+    for (i = 0; i < SUBSCRIBERS; i++)
+        pthread_join(tids[i], NULL);
+
+    smq_bcast_destroy(b);
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example forwards a vSMQ over a UNIX socket pair twice: first the
+** usual way, one vsmq_recv() and one write() per message, then with
+** smq_bridge_out(), which writes whole batches of frames per system
+** call. Both times smq_bridge_in() turns the stream back into messages
+** on a second vSMQ. In real use the two ends would be in different
+** processes.
+**
+** Compile: gcc smq.c vsmq.c smq_lz.c smq_bridge.c smq_bridge_example1.c -pthread -o smq_bridge_example1
+*/
+#include <stdint.h>
+#include <sys/socket.h>
+#include "smq_bridge.h"
+#include "smq_util.h"
+#include "vsmq.h"
+
+#define MESSAGES    200000
+
+static vSMQ src, dst;
+static int sv[2];
+
+/*
+** Send the same messages for both runs: "message <n>"
+*/
+static void produce(void) {
+    char msg[32];
+    int i;
+
+    for (i = 0; i < MESSAGES; i++)
+        vsmq_send(src, msg, snprintf(msg, sizeof(msg), "message %d", i) + 1, -1);
+}
+
+/*
+** Receive everything on the far side and check the last message
+*/
+static void consume(void) {
+    char *msg;
+    int i, sz;
+
+    for (i = 0; i < MESSAGES; i++) {
+        msg = vsmq_recv(dst, &sz, -1);
+        if (i == MESSAGES - 1)
+            printf("  last: %s\n", msg);
+        free (msg);
+    }
+}
+
+/*
+** The naive forwarder: one write per message
+*/
+static void *naive(void *arg) {
+    char frame[64];
+    uint32_t len;
+    void *msg;
+    int i, sz;
+
+    for (i = 0; i < MESSAGES; i++) {
+        msg = vsmq_recv(src, &sz, -1);
+        len = (uint32_t)sz;
+        memcpy(frame, &len, sizeof(len));
+        memcpy(frame + sizeof(len), msg, sz);
+        if (write(sv[0], frame, sizeof(len) + sz) < 0)
+            break;
+        free (msg);
+    }
+    return NULL;
+}
+
+int main(void) {
+    SMQBridge out, in;
+    SMQBridgeStats st;
+    pthread_t tid;
+    double t;
+
+    src = vsmq_create(0);
+    dst = vsmq_create(0);
+    if (!src || !dst || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "setup failed\n");
+        return -1;
+    }
+
+    if (!(in = smq_bridge_in(dst, sv[1], SMQ_BRIDGE_VSMQ))) {
+        fprintf(stderr, "Cannot start bridge\n");
+        return -1;
+    }
+
+    printf("write per message:\n");
+    t = gettime_dbl();
+    pthread_create(&tid, NULL, naive, NULL);
+    produce();
+    consume();
+    pthread_join(tid, NULL);
+    printf("  %.0f msgs/sec\n", MESSAGES / (gettime_dbl() - t));
+
+    printf("smq_bridge_out:\n");
+    t = gettime_dbl();
+    out = smq_bridge_out(src, sv[0], SMQ_BRIDGE_VSMQ);
+    produce();
+    consume();
+    printf("  %.0f msgs/sec\n", MESSAGES / (gettime_dbl() - t));
+
+    smq_bridge_stop(out, 1, &st);
+    printf("  %llu messages in %llu writes\n", st.messages, st.syscalls);
+
+    /* closing our end lets the reader see end of stream */
+    close(sv[0]);
+    smq_bridge_stop(in, 1, &st);
+    printf("reader: %llu messages in %llu reads\n", st.messages, st.syscalls);
+    close(sv[1]);
+
+    vsmq_destroy(src);
+    vsmq_destroy(dst);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example is smq_example1.c without the reader loop: a pool
+** started with smq_consume() owns the threads and hands the handler
+** batches of messages. smq_consume_stop() drains the queue at the end.
+**
+** Compile: gcc smq.c smq_consume.c smq_consume_example1.c -pthread -o smq_consume_example1
+*/
+#include "smq_consume.h"
+
+#define MAXVALUE    1000
+#define THREADS     4
+#define BATCH       32
+
+typedef struct st_iter {
+    int value;
+} ITER;
+
+static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+static long sum, batches;
+
+void myhandler(SMQ q, void *msgs, int n, void *arg) {
+    ITER *iter = msgs;
+    long local = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        local += iter[i].value;
+
+    pthread_mutex_lock(&sum_lock);
+    sum += local;
+    batches++;
+    pthread_mutex_unlock(&sum_lock);
+}
+
+int main(void) {
+    SMQ q;
+    SMQConsumer c;
+    ITER iter;
+    int i;
+
+    if (!(q = smq_create(sizeof(iter), 64, NULL))) {
+        fprintf(stderr, "Cannot create SMQ\n");
+        return -1;
+    }
+
+    if (!(c = smq_consume(q, myhandler, NULL, THREADS, BATCH, NULL))) {
+        fprintf(stderr, "Cannot start consumers\n");
+        smq_destroy(q);
+        return -1;
+    }
+
+    for (i = 0; i <= MAXVALUE; i++) {
+        iter.value = i;
+        smq_send(q, &iter, -1);
+    }
+
+    /* handle everything still queued, then stop */
+    smq_consume_stop(c, 1);
+
+    printf("sum %ld in %ld batches\n", sum, batches);
+
+    smq_destroy(q);
+
+    return 0;
+}
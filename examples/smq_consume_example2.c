@@ -0,0 +1,89 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example starts an elastic consumer with a single worker and
+** sends it a burst of slow messages. The monitor sees the oldest
+** message getting old and adds workers; once the burst is over the
+** extra workers go idle and are retired again.
+**
+** Compile: gcc smq.c smq_consume.c smq_consume_example2.c -pthread -o smq_consume_example2
+*/
+#include "smq_consume.h"
+
+#define BURST       400
+#define MAX_WORKERS 8
+
+typedef struct st_iter {
+    int value;
+} ITER;
+
+static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+static long sum;
+
+void myhandler(SMQ q, void *msgs, int n, void *arg) {
+    ITER *iter = msgs;
+    long local = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        /* pretend each message takes a while to handle */
+        usleep(2000);
+        local += iter[i].value;
+    }
+
+    pthread_mutex_lock(&sum_lock);
+    sum += local;
+    pthread_mutex_unlock(&sum_lock);
+}
+
+int main(void) {
+    SMQScaleConfig cfg = {
+        .min_workers = 1,
+        .max_workers = MAX_WORKERS,
+        .target_age = 0.02,
+        .cooldown = 0.2,
+        .interval_ms = 10,
+    };
+    SMQ q;
+    SMQConsumer c;
+    ITER iter;
+    int i, peak = 0, n;
+
+    if (!(q = smq_create(sizeof(iter), 0, NULL))) {
+        fprintf(stderr, "Cannot create SMQ\n");
+        return -1;
+    }
+
+    if (!(c = smq_consume_elastic(q, myhandler, NULL, 4, &cfg))) {
+        fprintf(stderr, "Cannot start consumers\n");
+        smq_destroy(q);
+        return -1;
+    }
+
+    for (i = 1; i <= BURST; i++) {
+        iter.value = i;
+        smq_send(q, &iter, -1);
+    }
+
+    while (smq_get_count(q) > 0) {
+        if ((n = smq_consume_get_workers(c)) > peak)
+            peak = n;
+        usleep(10000);
+    }
+    printf("burst handled with up to %d workers\n", peak);
+
+    /* let the extra workers cool down and be retired */
+    usleep(1000000);
+    printf("%d worker(s) after the burst\n", smq_consume_get_workers(c));
+
+    smq_consume_stop(c, 1);
+    printf("sum %ld\n", sum);
+
+    smq_destroy(q);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example runs many consumer coroutines on two executor threads
+** using smq::async_queue. A consumer waiting in ``co_await q.recv()''
+** does not hold a thread; it is resumed on the executor when a value
+** arrives. The end shows a timeout and a cancellation.
+**
+** Compile: g++ -std=c++20 -I.. smq_coro_example1.cpp -pthread -o smq_coro_example1
+*/
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "smq_coro.hpp"
+
+#define CONSUMERS   1000
+#define MAXVALUE    10000
+#define EXEC_THREADS 2
+
+/*
+** A fire-and-forget coroutine type; just enough for the example.
+*/
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*
+** A tiny executor: a locked deque of handles served by a few threads.
+*/
+class pool {
+public:
+    explicit pool(int n) {
+        for (int i = 0; i < n; i++)
+            threads_.emplace_back([this] { run(); });
+    }
+
+    ~pool() {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto &t : threads_)
+            t.join();
+    }
+
+    void post(std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> lock(lock_);
+
+        work_.push_back(h);
+        cond_.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        for (;;) {
+            cond_.wait(lock, [this] { return stop_ || !work_.empty(); });
+            if (work_.empty())
+                return;
+            auto h = work_.front();
+            work_.pop_front();
+            lock.unlock();
+            h.resume();
+            lock.lock();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<std::coroutine_handle<>> work_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
+static std::atomic<long> total { 0 };
+static std::atomic<int> finished { 0 };
+
+static task consumer(smq::async_queue<int, 256> &q) {
+    for (;;) {
+        std::optional<int> v = co_await q.recv();
+
+        /* -1 is our end marker */
+        if (!v || *v < 0)
+            break;
+        total += *v;
+    }
+    finished++;
+}
+
+static task producer(smq::async_queue<int, 256> &q) {
+    for (int i = 0; i <= MAXVALUE; i++)
+        co_await q.send(i);
+    for (int i = 0; i < CONSUMERS; i++)
+        co_await q.send(-1);
+}
+
+static task waits(smq::async_queue<int, 256> &q, int timeout_ms, std::stop_token st, const char *what) {
+    std::optional<int> v = co_await q.recv(timeout_ms, st);
+
+    std::printf("%s: %s\n", what, v ? "got a value" : "no value");
+    finished++;
+}
+
+int main() {
+    pool exec(EXEC_THREADS);
+    smq::async_queue<int, 256> q([&exec](std::coroutine_handle<> h) { exec.post(h); });
+    std::stop_source stop;
+
+    for (int i = 0; i < CONSUMERS; i++)
+        consumer(q);
+    producer(q);
+
+    while (finished < CONSUMERS)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::printf("%d consumers, sum %ld\n", CONSUMERS, total.load());
+
+    waits(q, 50, {}, "timeout");
+    waits(q, -1, stop.get_token(), "cancel");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stop.request_stop();
+
+    while (finished < CONSUMERS + 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example uses the header-only smq::queue<T, Capacity>. Events
+** (a trivially copyable struct) are memcpy'd through one queue and
+** std::string objects are moved through another; there is no onfree
+** callback and nothing is boxed.
+**
+** Compile: g++ -std=c++17 -I.. smq_cpp_example1.cpp -pthread -o smq_cpp_example1
+*/
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "smq.hpp"
+
+#define MAXVALUE    1000
+#define THREADS     4
+
+struct Event {
+    int id;
+    double value;
+};
+
+static smq::queue<Event, 64> events;
+static smq::queue<std::string, 16> words;
+
+static void myreader(long *sum) {
+    Event batch[16];
+    std::size_t n, i;
+
+    /* take up to 16 at a time; stop when nothing shows up for 100ms */
+    while ((n = events.pop_n(batch, 16, 100)) > 0) {
+        for (i = 0; i < n; i++)
+            *sum += batch[i].id;
+    }
+}
+
+int main() {
+    std::vector<std::thread> threads;
+    long sums[THREADS] = { 0 }, total = 0;
+    std::string word;
+    int i;
+
+    for (i = 0; i < THREADS; i++)
+        threads.emplace_back(myreader, &sums[i]);
+
+    for (i = 0; i <= MAXVALUE; i++)
+        events.push(Event { i, i * 0.5 });
+
+    for (auto &t : threads)
+        t.join();
+    for (i = 0; i < THREADS; i++)
+        total += sums[i];
+    std::printf("sum of ids: %ld\n", total);
+
+    /* strings are moved in and out of their slots */
+    words.emplace(5, 'x');
+    words.push(std::string("hello"));
+    while (words.try_pop(word))
+        std::printf("word: %s\n", word.c_str());
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example sums the numbers 0 through MAXVALUE by recursively
+** splitting the range into tiny tasks. Top level ranges are submitted
+** from main() through the injection queue; the halves are spawned onto
+** the worker's own deque where idle workers steal them.
+**
+** Compile: gcc smq.c smq_executor.c smq_executor_example1.c -pthread -o smq_executor_example1
+*/
+#include <stdatomic.h>
+#include "smq_executor.h"
+
+#define MAXVALUE    1000000
+#define CHUNKS      8
+#define LEAF        64
+#define WORKERS     4
+
+typedef struct st_range {
+    long lo, hi;
+} RANGE;
+
+static SMQExecutor ex;
+static atomic_long sum;
+
+void sum_range(void *_r) {
+    RANGE *r = _r;
+
+    if (r->hi - r->lo > LEAF) {
+        RANGE *left = malloc(sizeof(*left));
+        long mid = r->lo + (r->hi - r->lo) / 2;
+
+        /* hand the left half to whoever is free; keep the right half */
+        left->lo = r->lo;
+        left->hi = mid;
+        smq_executor_spawn(ex, sum_range, left);
+        r->lo = mid;
+        sum_range(r);
+        return;
+    }
+
+    for (long i = r->lo; i < r->hi; i++)
+        atomic_fetch_add_explicit(&sum, i, memory_order_relaxed);
+    free (r);
+}
+
+int main(void) {
+    long i, step = (MAXVALUE + 1) / CHUNKS + 1;
+
+    if (!(ex = smq_executor_create(WORKERS))) {
+        fprintf(stderr, "Cannot create executor\n");
+        return -1;
+    }
+
+    for (i = 0; i <= MAXVALUE; i += step) {
+        RANGE *r = malloc(sizeof(*r));
+
+        r->lo = i;
+        r->hi = i + step > MAXVALUE + 1 ? MAXVALUE + 1 : i + step;
+        smq_executor_submit(ex, sum_range, r);
+    }
+
+    /* runs everything to completion */
+    smq_executor_destroy(ex);
+
+    printf("sum %ld\n", (long)atomic_load(&sum));
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example posts deposits for a number of accounts to a
+** key-partitioned queue and has several workers apply them. Each
+** account's deposits are numbered; a worker checks that it always sees
+** the next one, which holds because a lane (and so every account on it)
+** is only ever held by one worker at a time.
+**
+** Compile: gcc smq.c smq_part.c smq_part_example1.c -pthread -o smq_part_example1
+*/
+#include "smq_part.h"
+
+#define ACCOUNTS    100
+#define DEPOSITS    1000
+#define LANES       16
+#define THREADS     4
+#define BATCH       8
+
+typedef struct st_deposit {
+    int account;
+    int seq;
+    int amount;
+} DEPOSIT;
+
+/*
+** Only touched by whichever worker holds the account's lane
+*/
+static long balance[ACCOUNTS];
+static int last_seq[ACCOUNTS];
+static int out_of_order;
+
+void *myworker(void *arg) {
+    SMQPart p = arg;
+    DEPOSIT d[BATCH];
+    int i, n, lane;
+
+    for (;;) {
+        if (!(n = smq_part_recv(p, d, NULL, BATCH, -1, &lane)))
+            continue;
+
+        for (i = 0; i < n; i++) {
+            /* an account of -1 tells the worker to leave */
+            if (d[i].account < 0) {
+                smq_part_release(p, lane);
+                return NULL;
+            }
+            if (d[i].seq != last_seq[d[i].account] + 1)
+                out_of_order++;
+            last_seq[d[i].account] = d[i].seq;
+            balance[d[i].account] += d[i].amount;
+        }
+
+        smq_part_release(p, lane);
+    }
+}
+
+int main(void) {
+    pthread_t tid[THREADS];
+    SMQPart p;
+    DEPOSIT d;
+    long total = 0;
+    int i, j;
+
+    if (!(p = smq_part_create(sizeof(d), LANES, 256, NULL))) {
+        fprintf(stderr, "Cannot create partitioned queue\n");
+        return -1;
+    }
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&tid[i], NULL, myworker, p);
+
+    for (j = 1; j <= DEPOSITS; j++) {
+        for (i = 0; i < ACCOUNTS; i++) {
+            d.account = i;
+            d.seq = j;
+            d.amount = j;
+            smq_send_keyed_part(p, (unsigned long)i, &d, -1);
+        }
+    }
+
+    /* one stop message per worker, each on a different key */
+    for (i = 0; i < THREADS; i++) {
+        d.account = -1;
+        smq_send_keyed_part(p, (unsigned long)(ACCOUNTS + i), &d, -1);
+    }
+    for (i = 0; i < THREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    for (i = 0; i < ACCOUNTS; i++)
+        total += balance[i];
+    printf("total %ld, %d out of order\n", total, out_of_order);
+
+    smq_part_destroy(p);
+
+    return 0;
+}
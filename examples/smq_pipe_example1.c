@@ -0,0 +1,92 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example runs a three stage pipeline (decode -> enrich -> persist)
+** on a single ring. The producer writes raw values directly into the
+** slots and every stage updates the same slot in place; nothing is
+** copied or allocated between stages.
+**
+** Compile: gcc smq.c smq_pipe.c smq_pipe_example1.c -pthread -o smq_pipe_example1
+*/
+#include "smq_pipe.h"
+
+#define MAXVALUE    1000
+#define STAGES      3
+
+typedef struct st_event {
+    int raw;
+    int decoded;
+    int enriched;
+} EVENT;
+
+static SMQP pipe_q;
+
+void *mystage(void *_stage) {
+    int stage = (int)(long)_stage;
+    unsigned long long seq;
+    long sum = 0;
+    int n, i, done = 0;
+
+    while (!done && (n = smq_pipe_wait(pipe_q, stage, &seq, 64, 1000)) > 0) {
+        for (i = 0; i < n; i++) {
+            EVENT *ev = smq_pipe_slot(pipe_q, seq + i);
+
+            /* -1 is our end marker; just pass it through */
+            if (ev->raw < 0) {
+                done = 1;
+                n = i + 1;
+                break;
+            }
+            if (stage == 0)
+                ev->decoded = ev->raw * 2;
+            else if (stage == 1)
+                ev->enriched = ev->decoded + 1;
+            else
+                sum += ev->enriched;
+        }
+        smq_pipe_done(pipe_q, stage, n);
+    }
+
+    if (stage == STAGES - 1)
+        printf("persisted sum: %ld\n", sum);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t tids[STAGES];
+    unsigned long long seq;
+    EVENT *ev;
+    long i;
+
+    if (!(pipe_q = smq_pipe_create(sizeof(EVENT), 64, STAGES))) {
+        fprintf(stderr, "Cannot create pipeline\n");
+        return -1;
+    }
+
+    for (i = 0; i < STAGES; i++)
+        pthread_create(&tids[i], NULL, mystage, (void *)i);
+
+    /* write each event straight into its slot */
+    for (i = 0; i <= MAXVALUE; i++) {
+        if (!(ev = smq_pipe_claim(pipe_q, &seq, -1)))
+            break;
+        ev->raw = (int)i;
+        smq_pipe_publish(pipe_q, seq);
+    }
+
+    if ((ev = smq_pipe_claim(pipe_q, &seq, -1))) {
+        ev->raw = -1;
+        smq_pipe_publish(pipe_q, seq);
+    }
+
+    for (i = 0; i < STAGES; i++)
+        pthread_join(tids[i], NULL);
+
+    smq_pipe_destroy(pipe_q);
+
+    return 0;
+}
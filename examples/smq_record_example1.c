@@ -0,0 +1,96 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example records a bursty vSMQ producer into a file, then replays
+** the recording into a fresh vSMQ at the original speed, ten times as
+** fast and as fast as possible, timing each run.
+**
+** Compile: gcc smq.c vsmq.c smq_lz.c smq_record.c smq_record_example1.c -pthread -o smq_record_example1
+*/
+#include "smq_record.h"
+#include "smq_util.h"
+#include "vsmq.h"
+
+#define BURSTS      10
+#define PER_BURST   1000
+#define MESSAGES    (BURSTS * PER_BURST)
+
+static const char *path = "/tmp/smq_record_example1.rec";
+
+/*
+** Receive (and check) every message of a run
+*/
+static void *consume(void *arg) {
+    vSMQ q = arg;
+    char expect[32];
+    char *msg;
+    int i, sz;
+
+    for (i = 0; i < MESSAGES; i++) {
+        msg = vsmq_recv(q, &sz, -1);
+        snprintf(expect, sizeof(expect), "message %d", i);
+        if (strcmp(msg, expect))
+            printf("  out of order: %s\n", msg);
+        free (msg);
+    }
+    return NULL;
+}
+
+static void replay(double speed) {
+    pthread_t tid;
+    long long n;
+    double t;
+    vSMQ q;
+
+    q = vsmq_create(0);
+    pthread_create(&tid, NULL, consume, q);
+
+    t = gettime_dbl();
+    n = smq_replay(q, path, speed, NULL);
+    pthread_join(tid, NULL);
+    printf("replay at %-4g: %lld messages in %.3f secs\n", speed, n, gettime_dbl() - t);
+
+    vsmq_destroy(q);
+}
+
+int main(void) {
+    SMQRecorder rec;
+    SMQRecordStats st;
+    pthread_t tid;
+    char msg[32];
+    int i, j;
+    double t;
+    vSMQ q;
+
+    q = vsmq_create(0);
+    if (!(rec = smq_record_start(q, path, SMQ_RECORD_VSMQ))) {
+        fprintf(stderr, "Cannot record to %s\n", path);
+        return -1;
+    }
+    pthread_create(&tid, NULL, consume, q);
+
+    /* a burst every 50ms */
+    t = gettime_dbl();
+    for (i = 0; i < BURSTS; i++) {
+        for (j = 0; j < PER_BURST; j++)
+            vsmq_send(q, msg, snprintf(msg, sizeof(msg), "message %d", i * PER_BURST + j) + 1, -1);
+        usleep(50000);
+    }
+    pthread_join(tid, NULL);
+    printf("recorded     : %d messages in %.3f secs\n", MESSAGES, gettime_dbl() - t);
+
+    smq_record_stop(rec, &st);
+    printf("  %llu messages, %llu bytes, %llu dropped\n", st.messages, st.bytes, st.dropped);
+    vsmq_destroy(q);
+
+    replay(1.0);
+    replay(10.0);
+    replay(0);
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example has client threads ask a server thread to square numbers,
+** first the old way, with a private reply SMQ created for every call,
+** then through smq_rpc, whose server takes requests and answers them in
+** batches: once a call at a time with smq_rpc_call(), and once keeping
+** several calls in flight with smq_rpc_send()/smq_rpc_wait().
+**
+** Compile: gcc smq.c smq_rpc.c smq_rpc_example1.c -pthread -o smq_rpc_example1
+*/
+#include "smq_rpc.h"
+#include "smq_util.h"
+
+#define CLIENTS     4
+#define CALLS       50000
+#define BATCH       32
+#define INFLIGHT    8
+
+/*
+** The old way: the request carries the queue to reply on
+*/
+typedef struct {
+    long n;
+    SMQ reply;
+} OLD_REQUEST;
+
+static SMQ oldq;
+static SMQRpc rpc;
+static int stop;
+static long errors;
+
+static void *old_server(void *arg) {
+    OLD_REQUEST req;
+    long sq;
+
+    while (smq_recv(oldq, &req, NULL, -1) > 0 && req.reply) {
+        sq = req.n * req.n;
+        smq_send(req.reply, &sq, -1);
+    }
+    return NULL;
+}
+
+static void *old_client(void *arg) {
+    OLD_REQUEST req;
+    long i, sq;
+
+    for (i = 0; i < CALLS; i++) {
+        req.n = i;
+        req.reply = smq_create(sizeof(long), 0, NULL);
+        smq_send(oldq, &req, -1);
+        smq_recv(req.reply, &sq, NULL, -1);
+        smq_destroy(req.reply);
+        if (sq != i * i)
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void *rpc_server(void *arg) {
+    SMQRpcId ids[BATCH];
+    long n[BATCH], sq[BATCH];
+    int i, got;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        if ((got = smq_rpc_recv(rpc, ids, n, BATCH, -1, &stop)) <= 0)
+            continue;
+        for (i = 0; i < got; i++)
+            sq[i] = n[i] * n[i];
+        smq_rpc_reply_batch(rpc, ids, sq, got);
+    }
+    return NULL;
+}
+
+static void *rpc_client(void *arg) {
+    long i, sq;
+
+    for (i = 0; i < CALLS; i++) {
+        if (smq_rpc_call(rpc, &i, &sq, -1) != 1 || sq != i * i)
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void *rpc_pipelined_client(void *arg) {
+    SMQRpcId ids[INFLIGHT];
+    long i, j, sq;
+
+    for (i = 0; i < CALLS; i += INFLIGHT) {
+        for (j = 0; j < INFLIGHT; j++) {
+            sq = i + j;
+            ids[j] = smq_rpc_send(rpc, &sq, -1);
+        }
+        for (j = 0; j < INFLIGHT; j++) {
+            if (smq_rpc_wait(rpc, ids[j], &sq, -1) != 1 || sq != (i + j) * (i + j))
+                __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*server)(void *), void *(*client)(void *)) {
+    pthread_t stid, ctid[CLIENTS];
+    double t;
+    int i;
+
+    t = gettime_dbl();
+    pthread_create(&stid, NULL, server, NULL);
+    for (i = 0; i < CLIENTS; i++)
+        pthread_create(&ctid[i], NULL, client, NULL);
+    for (i = 0; i < CLIENTS; i++)
+        pthread_join(ctid[i], NULL);
+    t = gettime_dbl() - t;
+
+    printf("%-18s: %.0f calls/sec, %.2f usecs/call\n", name,
+        CLIENTS * CALLS / t, t * 1000000.0 / (CLIENTS * CALLS));
+
+    /* release the server */
+    if (server == old_server) {
+        OLD_REQUEST req = { 0, NULL };
+
+        smq_send(oldq, &req, -1);
+    } else {
+        /* the interrupt is read by smq_rpc_recv() without our lock */
+        __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+        smq_rpc_wakeup(rpc);
+    }
+    pthread_join(stid, NULL);
+    __atomic_store_n(&stop, 0, __ATOMIC_RELEASE);
+}
+
+int main(void) {
+    oldq = smq_create(sizeof(OLD_REQUEST), 0, NULL);
+    rpc = smq_rpc_create(sizeof(long), sizeof(long), CLIENTS * INFLIGHT);
+    if (!oldq || !rpc) {
+        fprintf(stderr, "setup failed\n");
+        return -1;
+    }
+
+    run("reply SMQ per call", old_server, old_client);
+    run("smq_rpc", rpc_server, rpc_client);
+    run("smq_rpc pipelined", rpc_server, rpc_pipelined_client);
+    printf("errors: %ld\n", errors);
+
+    smq_destroy(oldq);
+    smq_rpc_destroy(rpc);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example is smq_example1.c written against a type-specialized
+** queue generated by SMQ_DEFINE_TYPED(). The element size and capacity
+** are compile-time constants and send/recv are inlined.
+**
+** Compile: gcc smq_typed_example1.c -pthread -o smq_typed_example1
+*/
+#include "smq_typed.h"
+
+#define MAXVALUE    100
+#define THREADS 8
+
+typedef struct st_iter {
+    int value;
+    int square;
+} ITER;
+
+SMQ_DEFINE_TYPED(iterq, ITER, 2)
+
+void *myreader(void *_q) {
+    iterq_t *q = _q;
+    ITER iter;
+
+    /* Read and print values */
+    while ((iterq_recv(q, &iter, 100)))
+        printf("ID gotten: %d (squared %d)\n", iter.value, iter.square);
+
+    return NULL;
+}
+
+int main(void) {
+    iterq_t *q;
+    ITER iter;
+    pthread_t tids[THREADS];
+    int i;
+
+    if (!(q = iterq_create())) {
+        fprintf(stderr, "Cannot create queue\n");
+        return -1;
+    }
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&tids[i], NULL, myreader, q);
+
+    for (i = 0; i <= MAXVALUE; i++) {
+        iter.value = i;
+        iter.square = i * i;
+
+        iterq_send(q, &iter, 100);
+    }
+
+    for (i = 0; i < THREADS; i++)
+        pthread_join(tids[i], NULL);
+
+    iterq_destroy(q);
+
+    return 0;
+}
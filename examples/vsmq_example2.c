@@ -0,0 +1,78 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+
+/*
+** This example queues JSON documents, each sent from a separately held
+** header and body with vsmq_sendv(), into a vSMQ which compresses
+** payloads of 1KB or more. The backlog builds up before a reader drains
+** it and checks every message arrives intact.
+**
+** Compile: gcc smq.c vsmq.c smq_lz.c vsmq_example2.c -pthread -o vsmq_example2
+*/
+#include "smq_lz.h"
+#include "smq_util.h"
+#include "vsmq.h"
+
+#define MESSAGES    20000
+
+/*
+** A multi-KB JSON body, much like what a service would emit
+*/
+static int make_body(char *buf, size_t cap, int n) {
+    int len, i;
+
+    len = snprintf(buf, cap, "{\"id\":%d,\"items\":[", n);
+    for (i = 0; i < 40; i++)
+        len += snprintf(buf + len, cap - len,
+            "%s{\"sku\":\"SKU-%06d\",\"qty\":%d,\"price\":%d.%02d,\"status\":\"pending\"}",
+            i ? "," : "", n * 40 + i, i % 7 + 1, 10 + i, n % 100);
+    len += snprintf(buf + len, cap - len, "]}");
+    return len;
+}
+
+int main(void) {
+    char header[64], body[8192], expect[8192 + 64], *msg, *c;
+    struct iovec iov[2];
+    int i, sz, hlen, blen, errors = 0;
+    double t;
+    vSMQ q;
+
+    q = vsmq_create(0);
+    vsmq_set_compression(q, 1024);
+
+    /* how well one message compresses */
+    blen = make_body(body, sizeof(body), 0);
+    c = malloc(SMQ_LZ_BOUND(blen));
+    printf("a %d byte body is held in %d bytes\n", blen, smq_lz_compress(body, blen, c, SMQ_LZ_BOUND(blen)));
+    free (c);
+
+    t = gettime_dbl();
+    for (i = 0; i < MESSAGES; i++) {
+        hlen = snprintf(header, sizeof(header), "POST /orders/%d\n", i);
+        blen = make_body(body, sizeof(body), i);
+
+        iov[0].iov_base = header;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = body;
+        iov[1].iov_len = blen;
+        vsmq_sendv(q, iov, 2, -1);
+    }
+    printf("queued %d messages in %.3f secs\n", vsmq_get_count(q), gettime_dbl() - t);
+
+    t = gettime_dbl();
+    for (i = 0; i < MESSAGES; i++) {
+        msg = vsmq_recv(q, &sz, 0);
+        hlen = snprintf(expect, sizeof(expect), "POST /orders/%d\n", i);
+        hlen += make_body(expect + hlen, sizeof(expect) - hlen, i);
+        if (!msg || sz != hlen || strcmp(msg, expect))
+            errors++;
+        free (msg);
+    }
+    printf("received and checked in %.3f secs, %d errors\n", gettime_dbl() - t, errors);
+
+    vsmq_destroy(q);
+    return 0;
+}
@@ -26,76 +26,103 @@
 ** Original Author: Keith Fralick
 */
 
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "smq.h"
+#include "smq_trace.h"
+#include "smq_util.h"
 
 /*
-** tv2dbl()
-**
-** Convert a struct timeval into a floating point(double) representing
-** the time.
+** Flat combining (smq_create_combining()). A thread wanting to send or
+** receive publishes the request in its slot; whichever thread gets the
+** lock applies every pending request in one pass and hands back the
+** results, so the lock changes hands once per pass rather than once per
+** message. Only requests which complete without waiting go this way; a
+** send to a full queue or a recv from an empty one falls back to the
+** normal path to block.
 */
-static double tv2dbl(struct timeval *tv) {
-    return (double)tv->tv_sec + ((double)tv->tv_usec / (double)1000000.0);
-}
+#define SMQ_FC_SLOTS        64
+#define SMQ_FC_PASSES       4
+#define SMQ_FC_SPINS        64
 
-/*
-** gettime_dbl()
-**
-** Return the current time as a floating point (double) value instead
-** of as a struct timeval *
-*/
-static double gettime_dbl(void) {
-    struct timeval tv;
+#define SMQ_FC_FREE         0
+#define SMQ_FC_CLAIMED      1
+#define SMQ_FC_PENDING      2
+#define SMQ_FC_DONE         3
 
-    gettimeofday(&tv, NULL);
-    return tv2dbl(&tv);
-}
+#define SMQ_FC_SEND         1
+#define SMQ_FC_RECV         2
+
+typedef struct st_smq_fc_slot {
+    _Alignas(64) atomic_int state;
+    int op;
+
+    /*
+    ** SMQ_FC_SEND: the item to link. SMQ_FC_RECV: the item unlinked,
+    ** or NULL if the queue was empty.
+    */
+    SMQItem item;
+
+    /*
+    ** 0 if the request was applied, 1 if it would have had to wait
+    */
+    int result;
+} SMQFCSlot;
+
+struct st_smq_fc {
+    /*
+    ** One past the highest slot ever claimed; the combiner scans no
+    ** further.
+    */
+    atomic_int nslots;
+    SMQFCSlot slots[SMQ_FC_SLOTS];
+};
 
-#ifdef INCLUDE_DB2TV
 /*
-** dbl2tv()
-**
-** Convert a floating point (double) value into a struct timeval where
-** tv_sec and tv_usec are populated for seconds and microseconds.
+** Preallocated item storage (smq_create_prealloc()). Items are padded
+** to a cache line so neighbouring messages don't share one; explicit
+** huge pages are assumed to be the usual 2MB.
 */
-static int dbl2tv(struct timeval *tv, double t) {
-    tv->tv_sec = (time_t)t;
-    tv->tv_usec = (suseconds_t) ((t - (double)tv->tv_sec) * 1000000);
-    return 0;
-}
-#endif
+#define SMQ_SLAB_ALIGN      64
+#define SMQ_HUGE_PAGE_SIZE  (2UL * 1024 * 1024)
+#define SMQ_MPOL_BIND       2
 
 /*
-** dbl2timespec()
-**
-** Convert a floating point (double) value into a struct timespec, used
-** for abstime in pthread_cond_timedwait(). Important to note here we use
-** nanoseconds instead of microseconds.
+** Per-thread identity used to pick a publication slot; 0 until the
+** thread first uses a combining queue.
 */
-static int dbl2timespec(struct timespec *spec, double t) {
-    spec->tv_sec = (time_t) t;
-    spec->tv_nsec = ((t - (double)spec->tv_sec) * 1000000000);
-    return 0;
-}
+static atomic_uint _smq_fc_nthreads = 0;
+static __thread unsigned int _smq_fc_self = 0;
 
+#ifdef SMQ_TRACE_HOOK
 /*
-** _smq_timeout_time()
-**
-** Given a timeout in milliseconds, get the current time and add to it
-** the milliseconds in the future for the exiration time; then, convert
-** this to struct timespec. This is to be used directly in pthread_cond_timedwait().
+** The in-process trace hook and its argument. See smq_set_trace_hook().
 */
-static int _smq_timeout_time(struct timespec *abstime, int timeout_ms) {
-    double current_time, expire_time;
-
-    /* fetch the current time as a double */
-    current_time = gettime_dbl();
-
-    /* calculate the expiration time, which is in the future */
-    expire_time = current_time + ((double)timeout_ms / (double)1000.0);
+SMQTraceHook _smq_trace_hook = NULL;
+void *_smq_trace_arg = NULL;
+#endif
 
-    return dbl2timespec(abstime, expire_time);
-}
+#ifdef SMQ_USDT
+/*
+** USDT probe semaphores (see smq_trace.h), bumped by attached tracers
+*/
+#define _SMQ_USDT_SEMAPHORE_DEF(name) \
+    __extension__ unsigned short smq_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes"))) = 0
+_SMQ_USDT_SEMAPHORE_DEF(enqueue);
+_SMQ_USDT_SEMAPHORE_DEF(dequeue);
+_SMQ_USDT_SEMAPHORE_DEF(block_start);
+_SMQ_USDT_SEMAPHORE_DEF(block_stop);
+_SMQ_USDT_SEMAPHORE_DEF(timeout);
+_SMQ_USDT_SEMAPHORE_DEF(signal);
+_SMQ_USDT_SEMAPHORE_DEF(wipe);
+#endif
 
 /*
 ** _smq_lock()
@@ -116,7 +143,17 @@ static int _smq_unlock(SMQ q) {
 }
 
 /*
-** _smq_cond_wait()
+** _smq_set_count()
+**
+** Update the item count. Busy-polling receivers read it without the
+** lock, so it is stored atomically; the caller holds the lock.
+*/
+static inline void _smq_set_count(SMQ q, int count) {
+    __atomic_store_n(&q->count, count, __ATOMIC_RELEASE);
+}
+
+/*
+** _smq_cond_wait_raw()
 **
 ** Wait for a change in the condition variable as prescribed. The
 ** ``sig'' argument is SMQ_SIG_READ or SMQ_SIG_WRITE depending on
@@ -124,7 +161,7 @@ static int _smq_unlock(SMQ q) {
 ** forever for notification; otherwise, the abstime specifies the time
 ** of expiration.
 */
-static int _smq_cond_wait(SMQ q, int sig, struct timespec *abstime) {
+static int _smq_cond_wait_raw(SMQ q, int sig, struct timespec *abstime) {
     /*
     ** If not NULL, expire at a specific time in the future (what we were
     ** provided.
@@ -148,6 +185,66 @@ static int _smq_cond_wait(SMQ q, int sig, struct timespec *abstime) {
     return -1;
 }
 
+/*
+** _smq_cond_wait()
+**
+** Wraps _smq_cond_wait_raw() with the block-start/stop and timeout
+** tracepoints. Compiles down to _smq_cond_wait_raw() when tracing is
+** not enabled.
+*/
+static int _smq_cond_wait(SMQ q, int sig, struct timespec *abstime) {
+#ifdef SMQ_TRACE_ENABLED
+    int retval;
+
+    SMQ_TRACE(block_start, SMQ_TRACE_BLOCK_START, q, sig);
+    retval = _smq_cond_wait_raw(q, sig, abstime);
+    SMQ_TRACE(block_stop, SMQ_TRACE_BLOCK_STOP, q, sig);
+    if (retval == ETIMEDOUT)
+        SMQ_TRACE(timeout, SMQ_TRACE_TIMEOUT, q, sig);
+    return retval;
+#else
+    return _smq_cond_wait_raw(q, sig, abstime);
+#endif
+}
+
+/*
+** _smq_wait_read()
+**
+** Wait for something to receive; the caller holds the lock. Normally
+** this is the condr wait. In busy-poll mode the lock is dropped and we
+** spin on the count, never sleeping, until an item shows up, abstime
+** passes (ETIMEDOUT) or ``interrupt'' is set.
+*/
+static int _smq_wait_read(SMQ q, struct timespec *abstime, volatile int *interrupt) {
+    unsigned long long empty = 0;
+    double deadline = 0;
+    int retval = 0;
+
+    if (!q->busy_poll)
+        return _smq_cond_wait(q, SMQ_SIG_READ, abstime);
+
+    if (abstime)
+        deadline = (double)abstime->tv_sec + (double)abstime->tv_nsec / 1000000000.0;
+
+    _smq_unlock(q);
+    while (!__atomic_load_n(&q->count, __ATOMIC_ACQUIRE)) {
+        empty++;
+        if (interrupt && __atomic_load_n(interrupt, __ATOMIC_ACQUIRE))
+            break;
+
+        /* reading the clock costs more than a poll; only now and then */
+        if (abstime && !(empty & 1023) && gettime_dbl() >= deadline) {
+            retval = ETIMEDOUT;
+            break;
+        }
+        _smq_cpu_relax();
+    }
+    __atomic_fetch_add(&q->empty_polls, empty, __ATOMIC_RELAXED);
+    _smq_lock(q);
+
+    return retval;
+}
+
 /*
 ** _smq_wait_for_write()
 **
@@ -205,6 +302,8 @@ static int _smq_wait_for_write(SMQ q, int ms) {
 */
 static int _smq_signal(SMQ q, int signal_type) {
     int retval = -1;
+
+    SMQ_TRACE(signal, SMQ_TRACE_SIGNAL, q, signal_type);
     switch (signal_type) {
         /*
         ** Notify a reader that there may be data available
@@ -228,6 +327,50 @@ static int _smq_signal(SMQ q, int signal_type) {
     return retval;
 }
 
+/*
+** _smq_insert()
+**
+** Add an SMQItem to the tail of the queue. The caller holds the lock,
+** has already waited for writability and notifies readers.
+*/
+static void _smq_insert(SMQ q, SMQItem item) {
+    /* If head is not defined, then set head and tail to the item */
+    if (!q->head) {
+        q->head = q->tail = item;
+    /*
+    ** otherwise, add to the tail
+    */
+    } else {
+        q->tail->next = item;
+        q->tail = q->tail->next;
+    }
+
+    /* increase count for number of items in queue */
+    _smq_set_count(q, q->count + 1);
+
+    SMQ_TRACE(enqueue, SMQ_TRACE_ENQUEUE, q, 0);
+
+    if (q->onrecord)
+        q->onrecord(q, item->msg, &item->tv, q->record_arg);
+}
+
+/*
+** _smq_append()
+**
+** Add an SMQItem to the tail of the queue and notify a reader. The
+** caller holds the lock and has already waited for writability.
+*/
+static void _smq_append(SMQ q, SMQItem item) {
+    _smq_insert(q, item);
+
+    /*
+    ** signal listening reader about a change/update to the queue;
+    ** busy-polling readers are not listening
+    */
+    if (!q->busy_poll)
+        _smq_signal(q, SMQ_SIG_READ);
+}
+
 /*
 ** _smq_link()
 **
@@ -248,50 +391,599 @@ static int _smq_link(SMQ q, SMQItem item, int ms) {
         return -1;
     }
 
-    /* If head is not defined, then set head and tail to the item */
-    if (!q->head) {
-        q->head = q->tail = item;
+    _smq_append(q, item);
+
+    /* unlock the mutex */
+    _smq_unlock(q);
+    return 0;
+}
+
+/*
+** Key data of an item in a conflating queue, placed just before the
+** item so that no other queue's items pay for it. Its size keeps the
+** item that follows aligned.
+*/
+typedef struct st_smq_key_hdr {
+    SMQItem knext;
+    unsigned long key;
+    int keyed;
+} SMQKeyHdr;
+
+#define _SMQ_KEY(item)  ((SMQKeyHdr *)((char *)(item) - sizeof(SMQKeyHdr)))
+
+/*
+** _smq_item_new()
+**
+** Allocate a zeroed item, with room for the key data in a conflating
+** queue. Free it with _smq_item_delete().
+*/
+static SMQItem _smq_item_new(SMQ q) {
+    size_t pre = q->conflating ? sizeof(SMQKeyHdr) : 0;
+    char *p;
+
+    if (!(p = calloc(1, pre + sizeof(struct st_simple_queue_item) + q->len)))
+        return NULL;
+    return (SMQItem)(p + pre);
+}
+
+/*
+** _smq_item_delete()
+**
+** Free an item from _smq_item_new().
+*/
+static void _smq_item_delete(SMQ q, SMQItem item) {
+    free (q->conflating ? (void *)_SMQ_KEY(item) : (void *)item);
+}
+
+/*
+** _smq_key_bucket()
+**
+** Return the address of the index bucket for ``key'' in a conflating
+** queue. Fibonacci hashing; the table size is a power of two.
+*/
+static SMQItem *_smq_key_bucket(SMQ q, unsigned long key) {
+    unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+
+    return &q->keys[q->key_bits ? (h >> (64 - q->key_bits)) : 0];
+}
+
+/*
+** _smq_key_find()
+**
+** Find the queued item for ``key'' or NULL. Requires the lock.
+*/
+static SMQItem _smq_key_find(SMQ q, unsigned long key) {
+    SMQItem item;
+
+    for (item = *_smq_key_bucket(q, key); item; item = _SMQ_KEY(item)->knext) {
+        if (_SMQ_KEY(item)->key == key)
+            return item;
+    }
+    return NULL;
+}
+
+/*
+** _smq_key_grow()
+**
+** Double the size of the key index once it averages more than two
+** items per bucket. Failure to grow is not an error; chains simply
+** get longer. Requires the lock.
+*/
+static void _smq_key_grow(SMQ q) {
+    SMQItem *old = q->keys, item, next;
+    int i, oldsize = 1 << q->key_bits;
+
+    if (q->nkeyed <= (oldsize << 1) || q->key_bits >= 30)
+        return;
+    if (!(q->keys = calloc(oldsize << 1, sizeof(*q->keys)))) {
+        q->keys = old;
+        return;
+    }
+    q->key_bits++;
+
+    for (i = 0; i < oldsize; i++) {
+        for (item = old[i]; item; item = next) {
+            SMQItem *bucket = _smq_key_bucket(q, _SMQ_KEY(item)->key);
+
+            next = _SMQ_KEY(item)->knext;
+            _SMQ_KEY(item)->knext = *bucket;
+            *bucket = item;
+        }
+    }
+    free (old);
+}
+
+/*
+** _smq_key_insert()
+**
+** Add a keyed item to the index. Requires the lock.
+*/
+static void _smq_key_insert(SMQ q, SMQItem item) {
+    SMQItem *bucket = _smq_key_bucket(q, _SMQ_KEY(item)->key);
+
+    _SMQ_KEY(item)->knext = *bucket;
+    *bucket = item;
+    q->nkeyed++;
+    _smq_key_grow(q);
+}
+
+/*
+** _smq_key_remove()
+**
+** Remove a keyed item (one being dequeued) from the index. Requires
+** the lock.
+*/
+static void _smq_key_remove(SMQ q, SMQItem item) {
+    SMQItem *pp;
+
+    for (pp = _smq_key_bucket(q, _SMQ_KEY(item)->key); *pp; pp = &_SMQ_KEY(*pp)->knext) {
+        if (*pp == item) {
+            *pp = _SMQ_KEY(item)->knext;
+            _SMQ_KEY(item)->knext = NULL;
+            q->nkeyed--;
+            return;
+        }
+    }
+}
+
+/*
+** _smq_key_replace()
+**
+** Overwrite the payload of an already queued item for the same key.
+** The superseded payload is handed to onfree() as it will never be
+** received. The update is traced and recorded like an insert (with
+** aux 1 and the time of this send). Requires the lock.
+*/
+static void _smq_key_replace(SMQ q, SMQItem item, void *data) {
+    struct timeval tv;
+
+    if (q->onfree)
+        q->onfree(&item->msg[0]);
+    memmove(item->msg, data, q->len);
+
+    SMQ_TRACE(enqueue, SMQ_TRACE_ENQUEUE, q, 1);
+
+    if (q->onrecord) {
+        gettimeofday(&tv, NULL);
+        q->onrecord(q, item->msg, &tv, q->record_arg);
+    }
+}
+
+/*
+** _smq_unlink_head()
+**
+** Remove and return the item at the head of the queue, or NULL if the
+** queue is empty. The caller holds the lock, copies out and frees the
+** item and notifies writers.
+*/
+static SMQItem _smq_unlink_head(SMQ q) {
+    SMQItem item;
+
+    if (!(item = q->head))
+        return NULL;
+
+    /* advance the head */
+    if (!(q->head = q->head->next))
+        q->head = q->tail = NULL;
+
+    /* conflating queue; the key is no longer pending */
+    if (q->conflating && _SMQ_KEY(item)->keyed)
+        _smq_key_remove(q, item);
+
+    /* reduce count of elements */
+    _smq_set_count(q, q->count - 1);
+
+    SMQ_TRACE(dequeue, SMQ_TRACE_DEQUEUE, q, 0);
+
+    return item;
+}
+
+/*
+** _smq_item_alloc()
+**
+** Get an item for a queue with preallocated storage: from the free
+** list, else the never used part of the slab. Senders only allocate
+** once there is room, so the max_count items of the slab suffice;
+** calloc() is only a safety net. The caller holds the lock.
+*/
+static SMQItem _smq_item_alloc(SMQ q) {
+    SMQItem item;
+
+    if ((item = q->slab_free))
+        q->slab_free = item->next;
+    else if (q->slab_used < q->slab_items)
+        item = (SMQItem)(q->slab + (size_t)q->slab_used++ * q->item_size);
+    else {
+        if ((item = calloc(1, sizeof(*item) + q->len)))
+            q->slab_heap++;
+        return item;
+    }
+
+    memset(item, 0, offsetof(struct st_simple_queue_item, msg));
+    return item;
+}
+
+/*
+** _smq_in_slab()
+**
+** Whether ``item'' is part of the queue's preallocated storage.
+*/
+static int _smq_in_slab(SMQ q, SMQItem item) {
+    return q->slab && (char *)item >= q->slab &&
+        (char *)item < q->slab + (size_t)q->slab_items * q->item_size;
+}
+
+/*
+** _smq_item_free()
+**
+** Release an item; slab items go back on the free list, which for a
+** queue with preallocated storage requires the lock.
+*/
+static void _smq_item_free(SMQ q, SMQItem item) {
+    if (_smq_in_slab(q, item)) {
+        item->next = q->slab_free;
+        q->slab_free = item;
+        return;
+    }
+    if (q->slab)
+        q->slab_heap--;
+    _smq_item_delete(q, item);
+}
+
+/*
+** _smq_slab_map()
+**
+** Map ``size'' bytes of anonymous memory for the slab, using explicit
+** huge pages if asked (and available) and falling back to normal pages
+** with a transparent huge page hint. The options which took effect are
+** added to ``flags''.
+*/
+static char *_smq_slab_map(size_t *size, int want, int *flags) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (want & SMQ_PREALLOC_HUGETLB) {
+        size_t huge = (*size + SMQ_HUGE_PAGE_SIZE - 1) & ~(SMQ_HUGE_PAGE_SIZE - 1);
+
+        p = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *size = huge;
+            *flags |= SMQ_PREALLOC_HUGETLB;
+            return p;
+        }
+    }
+#endif
+
+    *size = (*size + page - 1) & ~(page - 1);
+    if ((p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0)) == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
     /*
-    ** otherwise, add to the tail
+    ** Transparent huge pages: asked for directly, or in place of explicit
+    ** huge pages when there are none reserved (or no MAP_HUGETLB)
     */
-    } else {
-        q->tail->next = item;
-        q->tail = q->tail->next;
+    if ((want & (SMQ_PREALLOC_HUGEPAGE | SMQ_PREALLOC_HUGETLB)) &&
+        madvise(p, *size, MADV_HUGEPAGE) == 0)
+        *flags |= SMQ_PREALLOC_HUGEPAGE;
+#endif
+
+    return p;
+}
+
+/*
+** _smq_slab_bind()
+**
+** Bind the slab's pages to NUMA node ``node'' with mbind(2), called
+** directly so there is no dependency on libnuma. Must happen before the
+** pages are first touched. Returns 0 on success.
+*/
+static int _smq_slab_bind(char *slab, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[(node / (8 * sizeof(unsigned long))) + 1];
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return (int)syscall(SYS_mbind, slab, size, SMQ_MPOL_BIND, mask,
+        (unsigned long)(8 * sizeof(mask)), 0);
+#else
+    (void)slab;
+    (void)size;
+    (void)node;
+    return -1;
+#endif
+}
+
+/*
+** _smq_fc_combine()
+**
+** Apply every pending request of a combining queue. The caller holds
+** the lock. Readers and writers blocked on the normal path are woken
+** once for the whole pass.
+*/
+static void _smq_fc_combine(SMQ q) {
+    struct st_smq_fc *fc = q->fc;
+    SMQFCSlot *slot;
+    int i, pass, n, nslots, sent = 0, recvd = 0;
+
+    for (pass = 0; pass < SMQ_FC_PASSES; pass++) {
+        nslots = atomic_load_explicit(&fc->nslots, memory_order_acquire);
+        for (i = n = 0; i < nslots; i++) {
+            slot = &fc->slots[i];
+            if (atomic_load_explicit(&slot->state, memory_order_acquire) != SMQ_FC_PENDING)
+                continue;
+
+            slot->result = 0;
+            if (slot->op == SMQ_FC_SEND) {
+                if (q->max_count > 0 && q->count >= q->max_count)
+                    slot->result = 1;
+                else {
+                    _smq_insert(q, slot->item);
+                    sent++;
+                }
+            } else {
+                if ((slot->item = _smq_unlink_head(q)))
+                    recvd++;
+                else
+                    slot->result = 1;
+            }
+            atomic_store_explicit(&slot->state, SMQ_FC_DONE, memory_order_release);
+            n++;
+        }
+
+        /* nobody published anything while we were at it */
+        if (!n)
+            break;
+    }
+
+    /* busy-polling readers are not listening */
+    if (sent && !q->busy_poll) {
+        if (sent > 1)
+            pthread_cond_broadcast(&q->_tdata.condr);
+        else
+            _smq_signal(q, SMQ_SIG_READ);
+    }
+    if (recvd > 1 && q->max_count > 0)
+        pthread_cond_broadcast(&q->_tdata.condw);
+    else if (recvd)
+        _smq_signal(q, SMQ_SIG_WRITE);
+}
+
+/*
+** _smq_fc_apply()
+**
+** Publish a send (``*item'' to link) or recv (``*item'' receives the
+** unlinked item) in the calling thread's slot and wait until some
+** thread, quite possibly this one, has combined it.
+**
+** Returns 0 if the request was applied, 1 if it would have had to wait
+** (queue full or empty), or -1 if the slot is in use by another thread
+** and the caller should take the normal path.
+*/
+static int _smq_fc_apply(SMQ q, int op, SMQItem *item) {
+    struct st_smq_fc *fc = q->fc;
+    SMQFCSlot *slot;
+    int expect = SMQ_FC_FREE, idx, n, spins = 0, result;
+
+    if (!_smq_fc_self)
+        _smq_fc_self = atomic_fetch_add(&_smq_fc_nthreads, 1) + 1;
+    idx = (_smq_fc_self - 1) % SMQ_FC_SLOTS;
+    slot = &fc->slots[idx];
+
+    if (!atomic_compare_exchange_strong(&slot->state, &expect, SMQ_FC_CLAIMED))
+        return -1;
+
+    /* make sure combiners look this far */
+    n = atomic_load_explicit(&fc->nslots, memory_order_relaxed);
+    while (n <= idx && !atomic_compare_exchange_weak(&fc->nslots, &n, idx + 1))
+        ;
+
+    slot->op = op;
+    slot->item = op == SMQ_FC_SEND ? *item : NULL;
+    atomic_store_explicit(&slot->state, SMQ_FC_PENDING, memory_order_release);
+
+    while (atomic_load_explicit(&slot->state, memory_order_acquire) != SMQ_FC_DONE) {
+        if (pthread_mutex_trylock(&q->_tdata.lock) == 0) {
+            _smq_fc_combine(q);
+            _smq_unlock(q);
+            continue;
+        }
+
+        /* somebody else is combining; give them a moment */
+        if (++spins >= SMQ_FC_SPINS) {
+            sched_yield();
+            spins = 0;
+        } else
+            _smq_cpu_relax();
+    }
+
+    result = slot->result;
+    if (op == SMQ_FC_RECV)
+        *item = slot->item;
+    atomic_store_explicit(&slot->state, SMQ_FC_FREE, memory_order_release);
+    return result;
+}
+
+/*
+** Messages removed by smq_wipe() or smq_destroy(), waiting to be freed
+** once the queue lock has been dropped; possibly by the background
+** reclaimer.
+*/
+typedef struct st_smq_reclaim {
+    SMQItem head, tail;
+    int count;
+
+    /*
+    ** A superseded key index to free, or NULL
+    */
+    SMQItem *keys;
+
+    /*
+    ** Items were allocated with key data in front (see _smq_item_new())
+    */
+    int conflating;
+
+    void (*onfree)(void *);
+    struct st_smq_reclaim *next;
+} SMQReclaim;
+
+/*
+** The background reclaimer: a single thread shared by every queue,
+** started the first time it is needed.
+*/
+static pthread_mutex_t _smq_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _smq_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static SMQReclaim *_smq_reclaim_head = NULL, *_smq_reclaim_tail = NULL;
+static int _smq_reclaim_started = 0;
+
+/*
+** _smq_detach()
+**
+** Take every item off the queue in O(1): the list is handed over as a
+** whole in ``r'' and the key index is swapped for an empty one. Writers
+** waiting for room are woken. The caller holds the lock and reclaims
+** ``r'' after dropping it.
+*/
+static void _smq_detach(SMQ q, SMQReclaim *r) {
+    SMQItem *keys;
+
+    memset(r, 0, sizeof(*r));
+    r->head = q->head;
+    r->tail = q->tail;
+    r->count = q->count;
+    r->conflating = q->conflating;
+    r->onfree = q->onfree;
+
+    q->head = q->tail = NULL;
+    _smq_set_count(q, 0);
+
+    /* every keyed item is gone as well; a fresh table costs less than clearing */
+    if (q->keys && q->nkeyed) {
+        if ((keys = calloc(1, sizeof(*q->keys) << q->key_bits))) {
+            r->keys = q->keys;
+            q->keys = keys;
+        } else
+            memset(q->keys, 0, sizeof(*q->keys) << q->key_bits);
+        q->nkeyed = 0;
+    }
+
+    SMQ_TRACE(wipe, SMQ_TRACE_WIPE, q, r->count);
+
+    if (r->count && q->max_count > 0)
+        pthread_cond_broadcast(&q->_tdata.condw);
+}
+
+/*
+** _smq_reclaim_items()
+**
+** Call onfree() on and free the detached items of a queue without
+** preallocated storage. Needs no lock.
+*/
+static void _smq_reclaim_items(SMQReclaim *r) {
+    SMQItem item;
+
+    while ((item = r->head)) {
+        r->head = item->next;
+        if (r->onfree)
+            r->onfree (&item->msg[0]);
+        free (r->conflating ? (void *)_SMQ_KEY(item) : (void *)item);
+    }
+    free (r->keys);
+}
+
+/*
+** _smq_reclaimer()
+**
+** The background reclaimer thread.
+*/
+static void *_smq_reclaimer(void *arg) {
+    SMQReclaim *r;
+
+    (void)arg;
+    pthread_mutex_lock(&_smq_reclaim_lock);
+    for (;;) {
+        while (!(r = _smq_reclaim_head))
+            pthread_cond_wait(&_smq_reclaim_cond, &_smq_reclaim_lock);
+        if (!(_smq_reclaim_head = r->next))
+            _smq_reclaim_tail = NULL;
+
+        pthread_mutex_unlock(&_smq_reclaim_lock);
+        _smq_reclaim_items(r);
+        free (r);
+        pthread_mutex_lock(&_smq_reclaim_lock);
     }
+    return NULL;
+}
 
-    /* increase count for number of items in queue */
-    q->count++;
-
-    /* signal listening reader about a change/update to the queue */
-    _smq_signal(q, SMQ_SIG_READ);
+/*
+** _smq_reclaim_post()
+**
+** Hand detached items to the background reclaimer, starting it if need
+** be. Returns -1 if that is not possible and the caller should reclaim
+** them itself.
+*/
+static int _smq_reclaim_post(SMQReclaim *r) {
+    SMQReclaim *job;
+    pthread_t tid;
 
-    /* unlock the mutex */
-    _smq_unlock(q);
+    if (!(job = malloc(sizeof(*job))))
+        return -1;
+    *job = *r;
+    job->next = NULL;
+
+    pthread_mutex_lock(&_smq_reclaim_lock);
+    if (!_smq_reclaim_started) {
+        if (pthread_create(&tid, NULL, _smq_reclaimer, NULL)) {
+            pthread_mutex_unlock(&_smq_reclaim_lock);
+            free (job);
+            return -1;
+        }
+        pthread_detach(tid);
+        _smq_reclaim_started = 1;
+    }
+    if (_smq_reclaim_tail)
+        _smq_reclaim_tail->next = job;
+    else
+        _smq_reclaim_head = job;
+    _smq_reclaim_tail = job;
+    pthread_cond_signal(&_smq_reclaim_cond);
+    pthread_mutex_unlock(&_smq_reclaim_lock);
     return 0;
 }
 
 /*
-** _smq_wipe()
+** _smq_reclaim()
+**
+** Free what _smq_detach() took off a queue without preallocated
+** storage, in the calling thread or in the background as configured.
+** Called without the lock.
+*/
+static void _smq_reclaim(SMQ q, SMQReclaim *r) {
+    if (!r->head && !r->keys)
+        return;
+    if (q->reclaim == SMQ_RECLAIM_BACKGROUND && _smq_reclaim_post(r) == 0)
+        return;
+    _smq_reclaim_items(r);
+}
+
+/*
+** _smq_reclaim_onfree()
 **
-** Wipes/Removes all elements/items from the queue. Does not
-** lock. Do not use directly. See smq_wipe() for the thread-safe
-** version which should be used.
+** Call onfree() for every detached item of a queue with preallocated
+** storage; the items themselves go back to the slab afterwards.
 */
-static void _smq_wipe(SMQ q) {
+static void _smq_reclaim_onfree(SMQReclaim *r) {
     SMQItem item;
 
-    while ((item = q->head)) {
-        if (!(q->head = q->head->next))
-            q->head = q->tail = NULL;
-        item->next = NULL;
-        q->count--;
-        if (q->onfree)
-            q->onfree (&item->msg[0]);
-        free (item);
-    }
+    if (!r->onfree)
+        return;
+    for (item = r->head; item; item = item->next)
+        r->onfree (&item->msg[0]);
 }
 
-
 /*
 ************************************************************************
 **
@@ -339,6 +1031,137 @@ SMQ smq_create(int len, int max_count, void (*onfree)(void *)) {
     return q;
 }
 
+/*
+** smq_create_conflating()
+**
+** Create a conflating (latest-value-wins) queue. This is a normal SMQ
+** in every respect, but additionally accepts smq_send_keyed() where
+** only the newest message for each key is kept while it is waiting
+** to be received.
+**
+** Arguments are the same as smq_create(). The key index is sized from
+** max_count and grows as needed.
+*/
+SMQ smq_create_conflating(int len, int max_count, void (*onfree)(void *)) {
+    SMQ q;
+    int bits = 4;
+
+    if (!(q = smq_create(len, max_count, onfree)))
+        return NULL;
+
+    /* start with roughly one bucket per item we allow in the queue */
+    while (max_count > 0 && (1 << bits) < max_count && bits < 20)
+        bits++;
+    if (!(q->keys = calloc(1 << bits, sizeof(*q->keys)))) {
+        smq_destroy(q);
+        return NULL;
+    }
+    q->key_bits = bits;
+    q->conflating = 1;
+    return q;
+}
+
+/*
+** smq_create_combining()
+**
+** Create a queue using flat combining. This is a normal SMQ in every
+** respect (smq_send(), smq_recv() and FIFO order are unchanged); under
+** heavy contention, threads hand their sends and receives to whichever
+** thread holds the lock, which applies them all in one pass instead of
+** each thread taking the lock in turn.
+**
+** Arguments are the same as smq_create().
+*/
+SMQ smq_create_combining(int len, int max_count, void (*onfree)(void *)) {
+    SMQ q;
+
+    if (!(q = smq_create(len, max_count, onfree)))
+        return NULL;
+    if (!(q->fc = aligned_alloc(64, sizeof(*q->fc)))) {
+        smq_destroy(q);
+        return NULL;
+    }
+    memset(q->fc, 0, sizeof(*q->fc));
+    return q;
+}
+
+/*
+** smq_create_prealloc()
+**
+** Create a queue whose items live in storage allocated up front for
+** ``max_count'' messages rather than being allocated per message. With
+** the options below, large queues avoid the page faults and TLB misses
+** otherwise taken the first time they fill up, so latency is steady
+** from the first message. It is a normal SMQ in every other respect.
+**
+** @len, @max_count, @onfree: As for smq_create(); max_count must be
+**  greater than 0.
+** @flags: Any of
+**  SMQ_PREALLOC_HUGEPAGE: ask for transparent huge pages.
+**  SMQ_PREALLOC_HUGETLB: use explicit (reserved) huge pages, falling
+**   back to transparent huge pages if none are available.
+**  SMQ_PREALLOC_PREFAULT: touch every page now rather than on first use.
+**  SMQ_PREALLOC_MLOCK: lock the storage in memory.
+** @numa_node: Bind the storage to this NUMA node, or -1 for the default
+**  policy.
+**
+** Huge pages, mlock and NUMA binding are best effort; see
+** smq_get_prealloc_flags() for which took effect.
+**
+** Returns the SMQ object or NULL on error.
+*/
+SMQ smq_create_prealloc(int len, int max_count, void (*onfree)(void *), int flags,
+    int numa_node) {
+    SMQ q;
+    size_t i, page;
+
+    if (max_count <= 0)
+        return NULL;
+    if (!(q = smq_create(len, max_count, onfree)))
+        return NULL;
+
+    q->item_size = (int)((sizeof(struct st_simple_queue_item) + len + SMQ_SLAB_ALIGN - 1) &
+        ~(size_t)(SMQ_SLAB_ALIGN - 1));
+    q->slab_items = max_count;
+    q->slab_size = (size_t)max_count * q->item_size;
+
+    if (!(q->slab = _smq_slab_map(&q->slab_size, flags, &q->slab_flags))) {
+        smq_destroy(q);
+        return NULL;
+    }
+
+    /* placement has to be decided before anything touches the pages */
+    if (numa_node >= 0 && _smq_slab_bind(q->slab, q->slab_size, numa_node) == 0)
+        q->slab_flags |= SMQ_PREALLOC_NUMA;
+
+    if (flags & SMQ_PREALLOC_PREFAULT) {
+        /* one touch per page actually mapped */
+        if (q->slab_flags & SMQ_PREALLOC_HUGETLB)
+            page = SMQ_HUGE_PAGE_SIZE;
+        else
+            page = (size_t)sysconf(_SC_PAGESIZE);
+        for (i = 0; i < q->slab_size; i += page)
+            ((volatile char *)q->slab)[i] = 0;
+        q->slab_flags |= SMQ_PREALLOC_PREFAULT;
+    }
+
+    if ((flags & SMQ_PREALLOC_MLOCK) && mlock(q->slab, q->slab_size) == 0)
+        q->slab_flags |= SMQ_PREALLOC_MLOCK;
+
+    return q;
+}
+
+/*
+** smq_get_prealloc_flags()
+**
+** Return the SMQ_PREALLOC_* options which took effect for a queue made
+** by smq_create_prealloc() (SMQ_PREALLOC_NUMA if it was bound to the
+** requested node), or 0 for any other queue.
+*/
+int smq_get_prealloc_flags(SMQ q) {
+    return q->slab_flags;
+}
+
 /*
 ** smq_send()
 **
@@ -363,12 +1186,30 @@ SMQ smq_create(int len, int max_count, void (*onfree)(void *)) {
 */
 int smq_send(SMQ q, void *data, int wait_ms) {
     SMQItem item;
+    int rc;
 
     /* data cannot be NULL */
     if (!data)
         return -1;
 
-    if (!(item = calloc(1, sizeof(*item) + q->len)))
+    /*
+    ** Preallocated storage; the item comes off the free list, so wait
+    ** for room first and fill it in under the lock.
+    */
+    if (q->slab) {
+        _smq_lock(q);
+        if ((_smq_wait_for_write(q, wait_ms)) < 0 || !(item = _smq_item_alloc(q))) {
+            _smq_unlock(q);
+            return -1;
+        }
+        memmove(item->msg, data, q->len);
+        gettimeofday(&item->tv, NULL);
+        _smq_append(q, item);
+        _smq_unlock(q);
+        return 0;
+    }
+
+    if (!(item = _smq_item_new(q)))
         return -1;
     
     /* be sure this is set to 0 */
@@ -380,9 +1221,19 @@ int smq_send(SMQ q, void *data, int wait_ms) {
     /* record the time the message was received */
     gettimeofday(&item->tv, NULL);
 
+    /* combining queue; only a full queue needs the normal path */
+    if (q->fc && (rc = _smq_fc_apply(q, SMQ_FC_SEND, &item)) >= 0) {
+        if (rc == 0)
+            return 0;
+        if (wait_ms == 0) {
+            _smq_item_delete(q, item);
+            return -1;
+        }
+    }
+
     /* link/add the item into the list and notify consumer(s) */
     if ((_smq_link(q, item, wait_ms))) {
-        free (item);
+        _smq_item_delete(q, item);
         return -1;
     }
 
@@ -390,6 +1241,147 @@ int smq_send(SMQ q, void *data, int wait_ms) {
 }
 
 
+/*
+** smq_send_batch()
+**
+** Send ``n'' messages, taking the lock once rather than once per
+** message, and waking receivers once at the end. The messages are
+** queued back to back in the order given.
+**
+** @q: The queue object to write the data to.
+** @data: Array of ``n'' messages (n * len bytes). NULL is an error.
+** @n: The number of messages.
+** @wait_ms: As for smq_send(); applies to each message which has to
+**  wait for room.
+**
+** Returns the number of messages sent, which is less than ``n'' if
+** room did not become available in time, or < 0 on error.
+*/
+int smq_send_batch(SMQ q, void *data, int n, int wait_ms) {
+    SMQItem *items = NULL, item;
+    char *p = data;
+    int i, sent = 0;
+
+    if (!data || n < 0)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    /* without preallocated storage, copy everything in before locking */
+    if (!q->slab) {
+        if (!(items = calloc(n, sizeof(*items))))
+            return -1;
+        for (i = 0; i < n; i++) {
+            if (!(items[i] = _smq_item_new(q))) {
+                while (i-- > 0)
+                    _smq_item_delete(q, items[i]);
+                free (items);
+                return -1;
+            }
+            memmove(items[i]->msg, p + (size_t)i * q->len, q->len);
+            gettimeofday(&items[i]->tv, NULL);
+        }
+    }
+
+    _smq_lock(q);
+    for (; sent < n; sent++) {
+        if ((_smq_wait_for_write(q, wait_ms)) < 0)
+            break;
+        if (items)
+            item = items[sent];
+        else if ((item = _smq_item_alloc(q))) {
+            memmove(item->msg, p + (size_t)sent * q->len, q->len);
+            gettimeofday(&item->tv, NULL);
+        } else
+            break;
+        _smq_insert(q, item);
+
+        /* a receiver may be needed to make room for the rest */
+        if (q->max_count > 0 && q->count >= q->max_count && !q->busy_poll)
+            pthread_cond_broadcast(&q->_tdata.condr);
+    }
+    if (sent && !q->busy_poll) {
+        if (sent > 1)
+            pthread_cond_broadcast(&q->_tdata.condr);
+        else
+            _smq_signal(q, SMQ_SIG_READ);
+    }
+    _smq_unlock(q);
+
+    if (items) {
+        for (i = sent; i < n; i++)
+            _smq_item_delete(q, items[i]);
+        free (items);
+    }
+    return sent;
+}
+
+/*
+** smq_send_keyed()
+**
+** Send a message under ``key'' into a conflating queue (see
+** smq_create_conflating()). If a message with the same key is still
+** waiting in the queue, its payload is overwritten in place and it
+** keeps its original position (and send time); the superseded payload
+** is passed to onfree(), if set. Otherwise the message is queued as with
+** smq_send().
+**
+** @q: The conflating queue.
+** @key: The key; e.g. an instrument or host identifier.
+** @data: The message, ``len'' bytes. NULL is an error.
+** @wait_ms: Same as smq_send(); only used when a new item is queued.
+**
+** Returns: 0 on success, < 0 on error (including q not being a
+** conflating queue).
+*/
+int smq_send_keyed(SMQ q, unsigned long key, void *data, int wait_ms) {
+    SMQItem item, old;
+
+    if (!data)
+        return -1;
+
+    /* the common case under burst load: the key is already pending */
+    _smq_lock(q);
+    if (!q->keys) {
+        _smq_unlock(q);
+        return -1;
+    }
+    if ((old = _smq_key_find(q, key))) {
+        _smq_key_replace(q, old, data);
+        _smq_unlock(q);
+        return 0;
+    }
+    _smq_unlock(q);
+
+    if (!(item = _smq_item_new(q)))
+        return -1;
+    item->next = NULL;
+    _SMQ_KEY(item)->key = key;
+    _SMQ_KEY(item)->keyed = 1;
+    memmove(item->msg, data, q->len);
+    gettimeofday(&item->tv, NULL);
+
+    _smq_lock(q);
+    if ((_smq_wait_for_write(q, wait_ms)) < 0) {
+        _smq_unlock(q);
+        _smq_item_delete(q, item);
+        return -1;
+    }
+
+    /* someone may have queued the same key while we were unlocked */
+    if ((old = _smq_key_find(q, key))) {
+        _smq_key_replace(q, old, data);
+        _smq_unlock(q);
+        _smq_item_delete(q, item);
+        return 0;
+    }
+
+    _smq_key_insert(q, item);
+    _smq_append(q, item);
+    _smq_unlock(q);
+    return 0;
+}
+
 /*
 ** smq_recv()
 ** 
@@ -421,6 +1413,25 @@ int smq_recv(SMQ q, void *data, struct timeval *tv, int timeout_ms) {
     int retval = 0, value;
     struct timespec abstime, *_abstime = NULL;
 
+    /*
+    ** Combining queue; the item is unlinked for us and copied out here,
+    ** off the lock. Only an empty queue needs the normal path.
+    */
+    if (q->fc && _smq_fc_apply(q, SMQ_FC_RECV, &item) >= 0) {
+        if (item) {
+            if (tv)
+                memcpy(tv, &item->tv, sizeof(*tv));
+            if (data)
+                memmove(data, item->msg, q->len);
+            else if (q->onfree)
+                q->onfree(&item->msg[0]);
+            _smq_item_delete(q, item);
+            return 1;
+        }
+        if (timeout_ms == 0)
+            return 0;
+    }
+
     if (timeout_ms > 0) {
         _smq_timeout_time(&abstime, timeout_ms);
         _abstime = &abstime;
@@ -434,11 +1445,7 @@ int smq_recv(SMQ q, void *data, struct timeval *tv, int timeout_ms) {
     ** the condition is met, namely there is data to get.
     */
     for (; /* break inside */ ;) {
-        if ((item = q->head)) {
-            /* advance the head */
-            if (!(q->head = q->head->next)) 
-                q->head = q->tail = NULL;
-            
+        if ((item = _smq_unlink_head(q))) {
             /* copy the send time if requested */
             if (tv)
                 memcpy(tv, &item->tv, sizeof(*tv));
@@ -452,11 +1459,8 @@ int smq_recv(SMQ q, void *data, struct timeval *tv, int timeout_ms) {
             /* return value is > 0 indicating something exists */
             retval = 1;
 
-            /* reduce count of elements */
-            q->count--;
-
             /* free memory for the item */
-            free (item);
+            _smq_item_free(q, item);
 
             /* Notify potential writers which could be blocked */
             _smq_signal(q, SMQ_SIG_WRITE);
@@ -472,7 +1476,7 @@ int smq_recv(SMQ q, void *data, struct timeval *tv, int timeout_ms) {
         ** less than 0, we tend to wait forever; otherwise, we wait up to those
         ** milliseconds.
         */
-        if (timeout_ms == 0 || ((value = _smq_cond_wait(q, SMQ_SIG_READ, _abstime))))
+        if (timeout_ms == 0 || ((value = _smq_wait_read(q, _abstime, NULL))))
             break;
     }
 
@@ -482,24 +1486,164 @@ int smq_recv(SMQ q, void *data, struct timeval *tv, int timeout_ms) {
     return (retval);
 }
 
+/*
+** smq_recv_batch()
+**
+** Receive up to ``max'' messages under a single lock. Waits (as
+** smq_recv() does) only while the queue is empty; as soon as there is
+** at least one message, everything available up to ``max'' is taken.
+**
+** @q: The SMQ object to receive from.
+** @data: Array of at least ``max'' messages (max * len bytes). Unlike
+**  smq_recv(), data may not be NULL.
+** @tv: If not NULL, an array of ``max'' struct timeval receiving the
+**  send time of each message.
+** @max: The most messages to receive.
+** @timeout_ms: Same as for smq_recv().
+** @interrupt: If not NULL, read atomically with the lock held before
+**  each wait. Once it is non-zero the call returns instead of waiting.
+**  Set it (e.g. with __atomic_store_n()) and then call smq_wakeup() to
+**  release a blocked receiver.
+**
+** Returns the number of messages received (0 if none).
+*/
+int smq_recv_batch(SMQ q, void *data, struct timeval *tv, int max, int timeout_ms,
+    volatile int *interrupt) {
+    SMQItem item;
+    struct timespec abstime, *_abstime = NULL;
+    char *p = data;
+    int n = 0;
+
+    if (!data || max <= 0)
+        return 0;
+
+    if (timeout_ms > 0) {
+        _smq_timeout_time(&abstime, timeout_ms);
+        _abstime = &abstime;
+    }
+
+    _smq_lock(q);
+
+    for (; /* break inside */ ;) {
+        if (q->head) {
+            while (n < max && (item = _smq_unlink_head(q))) {
+                if (tv)
+                    memcpy(&tv[n], &item->tv, sizeof(*tv));
+                memmove(p, item->msg, q->len);
+                p += q->len;
+                n++;
+                _smq_item_free(q, item);
+            }
+
+            /* more than one slot may have opened up */
+            if (n > 1 && q->max_count > 0)
+                pthread_cond_broadcast(&q->_tdata.condw);
+            else
+                _smq_signal(q, SMQ_SIG_WRITE);
+            break;
+        }
+
+        if (timeout_ms == 0 || (interrupt && __atomic_load_n(interrupt, __ATOMIC_ACQUIRE)) ||
+            _smq_wait_read(q, _abstime, interrupt) == ETIMEDOUT)
+            break;
+    }
+
+    _smq_unlock(q);
+
+    return n;
+}
+
+/*
+** smq_wakeup()
+**
+** Wake every thread blocked receiving from the queue. Receivers
+** re-check the queue (and, for smq_recv_batch(), their interrupt flag)
+** and go back to waiting if there is nothing for them.
+*/
+void smq_wakeup(SMQ q) {
+    _smq_lock(q);
+    pthread_cond_broadcast(&q->_tdata.condr);
+    _smq_unlock(q);
+}
+
 /*
 ** smq_wipe()
 **
 ** Does not destroy the queue object itself. However, removes all
-** entries/items from the queue list.
+** entries/items from the queue list. The list is detached in one
+** step under the lock; onfree() and freeing the items happen after the
+** lock is released (or on a background thread; see smq_set_reclaim()),
+** so senders and receivers are not held up by a large wipe.
 **
 ** @q: The SMQ object where to remove all entries from.
 **
 */
 void smq_wipe(SMQ q) {
-    /* Need a lock on the queue */
+    SMQReclaim r;
+
+    /* take the whole list in one go */
     _smq_lock(q);
+    _smq_detach(q, &r);
+    _smq_unlock(q);
 
-    /* Call the non-locking function to remove entries */
-    _smq_wipe(q);
+    if (!q->slab) {
+        _smq_reclaim(q, &r);
+        return;
+    }
 
-    /* unlock */
+    /* preallocated storage: splice the whole chain back onto the free list */
+    _smq_reclaim_onfree(&r);
+    _smq_lock(q);
+    if (r.head) {
+        r.tail->next = q->slab_free;
+        q->slab_free = r.head;
+    }
+    _smq_unlock(q);
+    free (r.keys);
+}
+
+/*
+** smq_set_reclaim()
+**
+** Choose where smq_wipe() and smq_destroy() free the messages they
+** remove. Either way this happens without the queue lock held; with
+** SMQ_RECLAIM_BACKGROUND the caller does not wait for it at all, and
+** onfree() is called from a background thread shared by all queues.
+** Queues made by smq_create_prealloc() return their storage in one
+** step and always reclaim in the caller.
+**
+** @q: The SMQ object.
+** @mode: SMQ_RECLAIM_INLINE (the default) or SMQ_RECLAIM_BACKGROUND.
+**
+** Returns 0, or -1 for an unknown mode.
+*/
+int smq_set_reclaim(SMQ q, int mode) {
+    if (mode != SMQ_RECLAIM_INLINE && mode != SMQ_RECLAIM_BACKGROUND)
+        return -1;
+    q->reclaim = mode;
+    return 0;
+}
+
+/*
+** smq_set_record_hook()
+**
+** Install (or remove, if NULL) a function called with every message
+** as it is queued, in queue order. It runs with the queue's lock held,
+** so it must be quick and must not call back into the queue; see
+** smq_record_start() for a recorder built on it.
+**
+** @q: The SMQ object.
+** @hook: The function to call; see SMQRecordHook in smq.h.
+** @arg: Passed through as the last argument to the hook.
+**
+** Returns 0.
+*/
+int smq_set_record_hook(SMQ q, SMQRecordHook hook, void *arg) {
+    _smq_lock(q);
+    q->onrecord = hook;
+    q->record_arg = arg;
     _smq_unlock(q);
+    return 0;
 }
 
 /*
@@ -528,6 +1672,91 @@ int smq_get_count(SMQ q) {
     return count;
 }
 
+/*
+** smq_set_trace_hook()
+**
+** Install (or remove, if NULL) a process-wide function which is called
+** for every tracepoint event. The hook runs with the queue's lock held
+** so it must be quick and must not call back into the queue. Only
+** available when the library was built with SMQ_TRACE_HOOK.
+**
+** @hook: The function to call; see SMQTraceHook in smq.h.
+** @arg: Passed through as the last argument to the hook.
+**
+** Returns 0 on success or -1 if hooks are not compiled in.
+*/
+int smq_set_trace_hook(SMQTraceHook hook, void *arg) {
+#ifdef SMQ_TRACE_HOOK
+    __atomic_store_n(&_smq_trace_arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&_smq_trace_hook, hook, __ATOMIC_RELEASE);
+    return 0;
+#else
+    (void)hook;
+    (void)arg;
+    return -1;
+#endif
+}
+
+/*
+** smq_set_busy_poll()
+**
+** Switch a queue into (or out of) busy-poll mode. Receivers waiting on
+** an empty queue then spin on it (with a ``pause'' between polls)
+** instead of sleeping, and senders skip waking them, which removes the
+** futex wake from the enqueue-to-dequeue path. Each waiting receiver
+** keeps a CPU fully busy, so use it only with dedicated (ideally pinned;
+** see smq_consume()) consumer threads. Timeouts and smq_recv_batch()
+** interrupts work as usual.
+**
+** @q: The SMQ (or vSMQ) object.
+** @on: Non-zero to enable busy polling, zero to go back to sleeping.
+**
+** Returns 0.
+*/
+int smq_set_busy_poll(SMQ q, int on) {
+    _smq_lock(q);
+    q->busy_poll = on ? 1 : 0;
+
+    /* receivers already asleep re-check and start polling */
+    pthread_cond_broadcast(&q->_tdata.condr);
+    _smq_unlock(q);
+    return 0;
+}
+
+/*
+** smq_get_empty_polls()
+**
+** Return how many times busy-polling receivers have found the queue
+** empty. A rough measure of the CPU spent waiting in busy-poll mode.
+**
+** @q: The SMQ object.
+*/
+unsigned long long smq_get_empty_polls(SMQ q) {
+    return __atomic_load_n(&q->empty_polls, __ATOMIC_RELAXED);
+}
+
+/*
+** smq_get_head_age()
+**
+** Return how long (in seconds) the oldest message in the queue has
+** been waiting, based on its send time. Useful alongside
+** smq_get_count() to judge whether consumers are keeping up.
+**
+** @q: The SMQ object.
+**
+** Returns the age in seconds, or 0 if the queue is empty.
+*/
+double smq_get_head_age(SMQ q) {
+    double age = 0;
+
+    _smq_lock(q);
+    if (q->head)
+        age = gettime_dbl() - tv2dbl(&q->head->tv);
+    _smq_unlock(q);
+
+    return age > 0 ? age : 0;
+}
+
 /*
 ** smq_destroy()
 **
@@ -537,18 +1766,44 @@ int smq_get_count(SMQ q) {
 ** @q: The SMQ object to destroy
 */
 int smq_destroy(SMQ q) {
+    SMQReclaim r;
+    SMQItem item;
+
     /* perform a lock */
     _smq_lock(q);
 
-    /* remove any items still in the queue */
-    _smq_wipe(q);
+    /* take any items still in the queue */
+    _smq_detach(q, &r);
     pthread_cond_destroy(&q->_tdata.condr);
     pthread_cond_destroy(&q->_tdata.condw);
     _smq_unlock(q);
     pthread_mutex_destroy(&q->_tdata.lock);
 
+    if (q->slab) {
+        /*
+        ** Slab items go with the slab; only the (rare) heap items need
+        ** finding.
+        */
+        _smq_reclaim_onfree(&r);
+        if (r.head) {
+            r.tail->next = q->slab_free;
+            q->slab_free = r.head;
+        }
+        while (q->slab_heap > 0 && (item = q->slab_free)) {
+            q->slab_free = item->next;
+            if (!_smq_in_slab(q, item)) {
+                free (item);
+                q->slab_heap--;
+            }
+        }
+        munmap(q->slab, q->slab_size);
+        free (r.keys);
+    } else
+        _smq_reclaim(q, &r);
+
+    free (q->keys);
+    free (q->fc);
     free (q);
 
     return 0;
 }
-
@@ -65,7 +65,64 @@ typedef struct st_simple_queue {
 
     void (*onfree)(void *);
 
+    /*
+    ** Opaque to the core: private state of the wrapper which supplied
+    ** onfree (vsmq.c's vSMQ control block), freed by that wrapper
+    */
+    void *onfree_ctx;
+
     SMQItem head, tail;
+
+    /*
+    ** Key index for conflating queues (smq_create_conflating()),
+    ** otherwise NULL. A table of (1 << key_bits) buckets holding
+    ** nkeyed items. Only the items of a conflating queue carry key
+    ** data, in a header just before each item (private to smq.c).
+    */
+    SMQItem *keys;
+    int key_bits;
+    int nkeyed;
+    int conflating;
+
+    /*
+    ** Flat-combining publication slots (smq_create_combining()),
+    ** otherwise NULL. Private to smq.c.
+    */
+    struct st_smq_fc *fc;
+
+    /*
+    ** Busy-poll mode (smq_set_busy_poll()): receivers spin on ``count''
+    ** instead of sleeping and senders never signal them. empty_polls
+    ** counts the polls which found the queue empty.
+    */
+    int busy_poll;
+    unsigned long long empty_polls;
+
+    /*
+    ** Preallocated item storage (smq_create_prealloc()), otherwise
+    ** NULL. Items are taken from the free list, then from the part of
+    ** the slab never used yet (slab_used onwards) and only then from
+    ** calloc() (slab_heap of those are outstanding). slab_flags holds
+    ** the SMQ_PREALLOC_* options which took effect.
+    */
+    char *slab;
+    size_t slab_size;
+    int item_size;
+    int slab_items, slab_used, slab_heap;
+    int slab_flags;
+    SMQItem slab_free;
+
+    /*
+    ** SMQ_RECLAIM_INLINE or SMQ_RECLAIM_BACKGROUND; see smq_set_reclaim()
+    */
+    int reclaim;
+
+    /*
+    ** Called for every message queued; see smq_set_record_hook()
+    */
+    void (*onrecord)(struct st_simple_queue *, const void *, const struct timeval *, void *);
+    void *record_arg;
+
     struct {
         pthread_mutex_t lock;
 
@@ -82,13 +139,73 @@ typedef struct st_simple_queue {
     } _tdata;
 } *SMQ;
 
+/*
+** Options for smq_create_prealloc()
+*/
+#define SMQ_PREALLOC_HUGEPAGE   0x01    /* transparent huge pages (MADV_HUGEPAGE) */
+#define SMQ_PREALLOC_HUGETLB    0x02    /* explicit huge pages (MAP_HUGETLB) */
+#define SMQ_PREALLOC_PREFAULT   0x04    /* touch every page at creation */
+#define SMQ_PREALLOC_MLOCK      0x08    /* lock the storage in memory */
+#define SMQ_PREALLOC_NUMA       0x10    /* placed on the requested node (result only) */
+
+/*
+** Where smq_wipe() and smq_destroy() free the messages they remove
+*/
+#define SMQ_RECLAIM_INLINE      0   /* in the caller, after dropping the lock */
+#define SMQ_RECLAIM_BACKGROUND  1   /* on a shared background thread */
+
+/*
+** Tracepoint events. See smq_trace.h; these are only emitted when the
+** library is built with SMQ_USDT and/or SMQ_TRACE_HOOK. The ``aux''
+** value passed along with each event is:
+**
+**  SMQ_TRACE_ENQUEUE       0, or 1 for a conflating update in place
+**  SMQ_TRACE_DEQUEUE       0
+**  SMQ_TRACE_BLOCK_START   SMQ_SIG_READ or SMQ_SIG_WRITE being waited on
+**  SMQ_TRACE_BLOCK_STOP    SMQ_SIG_READ or SMQ_SIG_WRITE being waited on
+**  SMQ_TRACE_TIMEOUT       SMQ_SIG_READ or SMQ_SIG_WRITE which timed out
+**  SMQ_TRACE_SIGNAL        SMQ_SIG_READ or SMQ_SIG_WRITE being signalled
+**  SMQ_TRACE_WIPE          number of items removed
+*/
+#define SMQ_TRACE_ENQUEUE       1
+#define SMQ_TRACE_DEQUEUE       2
+#define SMQ_TRACE_BLOCK_START   3
+#define SMQ_TRACE_BLOCK_STOP    4
+#define SMQ_TRACE_TIMEOUT       5
+#define SMQ_TRACE_SIGNAL        6
+#define SMQ_TRACE_WIPE          7
+
+typedef void (*SMQTraceHook)(int event, SMQ q, int depth, int aux,
+    unsigned long long ts_ns, void *arg);
+
+/*
+** Called with each message as it is queued (``msg'' is ``len'' bytes,
+** not necessarily aligned; for a vSMQ, its vSMQ_WRAP) and the time it
+** was sent. See smq_record.h.
+*/
+typedef void (*SMQRecordHook)(SMQ q, const void *msg, const struct timeval *tv, void *arg);
+
 
 extern SMQ smq_create(int, int, void (*)(void *));
+extern SMQ smq_create_conflating(int, int, void (*)(void *));
+extern SMQ smq_create_combining(int, int, void (*)(void *));
+extern SMQ smq_create_prealloc(int, int, void (*)(void *), int, int);
+extern int smq_get_prealloc_flags(SMQ);
 extern int smq_send(SMQ, void *, int);
+extern int smq_send_batch(SMQ, void *, int, int);
+extern int smq_send_keyed(SMQ, unsigned long, void *, int);
 extern int smq_recv(SMQ, void *, struct timeval *, int);
+extern int smq_recv_batch(SMQ, void *, struct timeval *, int, int, volatile int *);
+extern void smq_wakeup(SMQ);
 extern int smq_get_count(SMQ);
+extern double smq_get_head_age(SMQ);
 extern int smq_destroy(SMQ);
 extern void smq_wipe(SMQ);
+extern int smq_set_reclaim(SMQ, int);
+extern int smq_set_record_hook(SMQ, SMQRecordHook, void *);
+extern int smq_set_trace_hook(SMQTraceHook, void *);
+extern int smq_set_busy_poll(SMQ, int);
+extern unsigned long long smq_get_empty_polls(SMQ);
 
 
 #endif /* __SMQ_H__ */
\ No newline at end of file
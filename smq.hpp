@@ -0,0 +1,338 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Header-only, typed C++ (C++17) flavour of SMQ.
+**
+** smq::queue<T, Capacity> keeps SMQ's model -- a mutex, a read and a
+** write condition variable and millisecond timeouts where < 0 waits
+** forever, 0 tries once and > 0 waits that long -- but stores elements
+** in a fixed ring of Capacity slots:
+**
+**  - trivially copyable T is copied with a memcpy of sizeof(T), a size
+**    known at compile time;
+**  - any other T is move-constructed into its slot and moved back out,
+**    so there is no onfree callback and no boxing through vSMQ;
+**  - a power-of-two Capacity turns the index wrap into a mask.
+**
+** Note this is not a wrapper over the C library: it shares SMQ's
+** semantics but none of its code, and needs no libsmq to link. SMQ
+** stores each message as ``len'' raw bytes copied with memmove(), so it
+** cannot hold a T which is not trivially copyable (std::string,
+** std::unique_ptr, ...) without boxing it vSMQ-style with an onfree
+** callback, and it allocates per message where a compile-time Capacity
+** allows in-place storage. Changes to SMQ's waiting and timeout rules
+** must be mirrored here (and in smq_coro.hpp, which uses the same ring).
+*/
+
+#ifndef __SMQ_HPP__
+#define __SMQ_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace smq {
+
+namespace detail {
+
+/*
+** ring
+**
+** Fixed capacity FIFO storage. Not thread-safe; the queue types
+** provide the locking.
+*/
+template <typename T, std::size_t Capacity>
+class ring {
+    static_assert(Capacity > 0, "smq: Capacity must be greater than 0");
+
+public:
+    static constexpr bool trivial = std::is_trivially_copyable<T>::value;
+    static constexpr bool pow2 = (Capacity & (Capacity - 1)) == 0;
+
+    ring() = default;
+    ring(const ring &) = delete;
+    ring &operator=(const ring &) = delete;
+
+    ~ring() {
+        if (!std::is_trivially_destructible<T>::value) {
+            while (count_)
+                drop_front();
+        }
+    }
+
+    bool empty() const { return count_ == 0; }
+    bool full() const { return count_ == Capacity; }
+    std::size_t size() const { return count_; }
+
+    /*
+    ** push_back()
+    **
+    ** Copy or move a value into the next free slot. Caller checks
+    ** full() first.
+    */
+    template <typename U>
+    void push_back(U &&v) {
+        T *p = slot(head_ + count_);
+
+        if constexpr (trivial && std::is_same<typename std::decay<U>::type, T>::value)
+            std::memcpy(static_cast<void *>(p), static_cast<const void *>(&v), sizeof(T));
+        else
+            ::new (static_cast<void *>(p)) T(std::forward<U>(v));
+        ++count_;
+    }
+
+    /*
+    ** emplace_back()
+    **
+    ** Construct a value in place in the next free slot.
+    */
+    template <typename... Args>
+    void emplace_back(Args &&...args) {
+        ::new (static_cast<void *>(slot(head_ + count_))) T(std::forward<Args>(args)...);
+        ++count_;
+    }
+
+    /*
+    ** pop_front()
+    **
+    ** Move the oldest value into ``out'' and release its slot. Caller
+    ** checks empty() first.
+    */
+    void pop_front(T &out) {
+        T *p = slot(head_);
+
+        if constexpr (trivial) {
+            std::memcpy(static_cast<void *>(&out), static_cast<const void *>(p), sizeof(T));
+        } else {
+            out = std::move(*p);
+            p->~T();
+        }
+        head_ = index(head_ + 1);
+        --count_;
+    }
+
+    /*
+    ** drop_front()
+    **
+    ** Destroy the oldest value without moving it anywhere.
+    */
+    void drop_front() {
+        slot(head_)->~T();
+        head_ = index(head_ + 1);
+        --count_;
+    }
+
+private:
+    static constexpr std::size_t index(std::size_t i) {
+        if constexpr (pow2)
+            return i & (Capacity - 1);
+        else
+            return i % Capacity;
+    }
+
+    T *slot(std::size_t i) {
+        return std::launder(reinterpret_cast<T *>(storage_) + index(i));
+    }
+
+    alignas(T) unsigned char storage_[sizeof(T) * Capacity];
+    std::size_t head_ = 0;
+    std::size_t count_ = 0;
+};
+
+} /* namespace detail */
+
+/*
+** queue
+**
+** Thread-safe bounded queue of T. All waiting functions take a timeout
+** in milliseconds with the same meaning as smq_send()/smq_recv().
+*/
+template <typename T, std::size_t Capacity>
+class queue {
+public:
+    using value_type = T;
+
+    queue() = default;
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+    /*
+    ** push()
+    **
+    ** Copy or move ``v'' into the queue, waiting up to timeout_ms for
+    ** room. Returns true on success.
+    */
+    bool push(const T &v, int timeout_ms = -1) { return put(timeout_ms, v); }
+    bool push(T &&v, int timeout_ms = -1) { return put(timeout_ms, std::move(v)); }
+    bool try_push(const T &v) { return put(0, v); }
+    bool try_push(T &&v) { return put(0, std::move(v)); }
+
+    /*
+    ** emplace()
+    **
+    ** Construct an element in place, waiting as long as needed for
+    ** room. try_emplace() does not wait.
+    */
+    template <typename... Args>
+    bool emplace(Args &&...args) { return emplace_wait(-1, std::forward<Args>(args)...); }
+
+    template <typename... Args>
+    bool try_emplace(Args &&...args) { return emplace_wait(0, std::forward<Args>(args)...); }
+
+    template <typename... Args>
+    bool emplace_wait(int timeout_ms, Args &&...args) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (!wait_for(lock, condw_, wwait_, timeout_ms, [this] { return !ring_.full(); }))
+            return false;
+        ring_.emplace_back(std::forward<Args>(args)...);
+        notify(condr_, rwait_);
+        return true;
+    }
+
+    /*
+    ** pop()
+    **
+    ** Move the oldest element into ``out'', waiting up to timeout_ms
+    ** for one. Returns true if an element was received.
+    */
+    bool pop(T &out, int timeout_ms = -1) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (!wait_for(lock, condr_, rwait_, timeout_ms, [this] { return !ring_.empty(); }))
+            return false;
+        ring_.pop_front(out);
+        notify(condw_, wwait_);
+        return true;
+    }
+
+    bool try_pop(T &out) { return pop(out, 0); }
+
+    /*
+    ** push_n()
+    **
+    ** Move up to ``n'' elements starting at ``first'' into the queue
+    ** under a single lock, waiting up to timeout_ms for room for at
+    ** least one. Returns the number of elements queued.
+    */
+    template <typename It>
+    std::size_t push_n(It first, std::size_t n, int timeout_ms = -1) {
+        std::unique_lock<std::mutex> lock(lock_);
+        std::size_t done = 0;
+
+        if (!n || !wait_for(lock, condw_, wwait_, timeout_ms, [this] { return !ring_.full(); }))
+            return 0;
+        for (; done < n && !ring_.full(); ++done, ++first)
+            ring_.push_back(std::move(*first));
+        notify_all(condr_, rwait_);
+        return done;
+    }
+
+    template <typename It>
+    std::size_t try_push_n(It first, std::size_t n) { return push_n(first, n, 0); }
+
+    /*
+    ** pop_n()
+    **
+    ** Move up to ``max'' elements into ``out'' (an output iterator)
+    ** under a single lock, waiting up to timeout_ms for at least one.
+    ** Returns the number of elements received.
+    */
+    template <typename OutIt>
+    std::size_t pop_n(OutIt out, std::size_t max, int timeout_ms = -1) {
+        std::unique_lock<std::mutex> lock(lock_);
+        std::size_t done = 0;
+
+        if (!max || !wait_for(lock, condr_, rwait_, timeout_ms, [this] { return !ring_.empty(); }))
+            return 0;
+        for (; done < max && !ring_.empty(); ++done, ++out)
+            ring_.pop_front(*out);
+        notify_all(condw_, wwait_);
+        return done;
+    }
+
+    template <typename OutIt>
+    std::size_t try_pop_n(OutIt out, std::size_t max) { return pop_n(out, max, 0); }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return ring_.size();
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    template <typename U>
+    bool put(int timeout_ms, U &&v) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (!wait_for(lock, condw_, wwait_, timeout_ms, [this] { return !ring_.full(); }))
+            return false;
+        ring_.push_back(std::forward<U>(v));
+        notify(condr_, rwait_);
+        return true;
+    }
+
+    /*
+    ** wait_for()
+    **
+    ** Wait on ``cond'' until ``ready'' holds, following the SMQ timeout
+    ** convention. ``waiters'' counts threads blocked on cond so the other
+    ** side only signals when someone is actually waiting.
+    */
+    template <typename Pred>
+    static bool wait_for(std::unique_lock<std::mutex> &lock, std::condition_variable &cond,
+        int &waiters, int timeout_ms, Pred ready) {
+        bool ok;
+
+        if (ready())
+            return true;
+        if (timeout_ms == 0)
+            return false;
+
+        ++waiters;
+        if (timeout_ms < 0) {
+            cond.wait(lock, ready);
+            ok = true;
+        } else {
+            ok = cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        }
+        --waiters;
+        return ok;
+    }
+
+    static void notify(std::condition_variable &cond, int waiters) {
+        if (waiters)
+            cond.notify_one();
+    }
+
+    static void notify_all(std::condition_variable &cond, int waiters) {
+        if (waiters)
+            cond.notify_all();
+    }
+
+    mutable std::mutex lock_;
+    std::condition_variable condr_;
+    std::condition_variable condw_;
+    int rwait_ = 0;
+    int wwait_ = 0;
+    detail::ring<T, Capacity> ring_;
+};
+
+} /* namespace smq */
+
+#endif /* __SMQ_HPP__ */
@@ -0,0 +1,345 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Broadcast (pub-sub) queue. A single ring of fixed size slots is
+** shared by every subscriber; each subscriber only holds a read cursor
+** (sequence number). A message is written once no matter how many
+** subscribers there are, and a slot is reused only when every
+** subscriber has read it (or, depending on the policy, when lagging
+** subscribers are skipped forward or dropped).
+*/
+
+#include "smq_bcast.h"
+#include "smq_util.h"
+
+/*
+** _smq_bcast_slot()
+**
+** Address of the slot used for sequence ``seq''.
+*/
+static char *_smq_bcast_slot(SMQB b, unsigned long long seq) {
+    return b->slots + (size_t)(seq % (unsigned long long)b->capacity) * b->slot_size;
+}
+
+/*
+** _smq_bcast_min()
+**
+** The lowest cursor of all active subscribers. If there are no
+** subscribers, nothing gates the writer and head is returned. Must be
+** called with the lock held.
+*/
+static unsigned long long _smq_bcast_min(SMQB b) {
+    unsigned long long min = b->head;
+    int i;
+
+    for (i = 0; i < b->nsubs; i++) {
+        if (b->subs[i]->active && b->subs[i]->seq < min)
+            min = b->subs[i]->seq;
+    }
+    return min;
+}
+
+/*
+** _smq_bcast_wait()
+**
+** Wait on condr or condw; abstime of NULL waits forever.
+*/
+static int _smq_bcast_wait(SMQB b, int sig, struct timespec *abstime) {
+    pthread_cond_t *cond = (sig == SMQ_SIG_READ) ? &b->_tdata.condr : &b->_tdata.condw;
+
+    if (abstime)
+        return pthread_cond_timedwait(cond, &b->_tdata.lock, abstime);
+    return pthread_cond_wait(cond, &b->_tdata.lock);
+}
+
+/*
+** _smq_bcast_make_room()
+**
+** Called with the lock held when the ring is full. Apply the
+** skip/drop policy to every subscriber sitting on the oldest slot.
+*/
+static void _smq_bcast_make_room(SMQB b) {
+    unsigned long long oldest = b->head - (unsigned long long)b->capacity;
+    int i;
+
+    for (i = 0; i < b->nsubs; i++) {
+        SMQBSub sub = b->subs[i];
+
+        if (!sub->active || sub->seq > oldest)
+            continue;
+        if (b->policy == SMQ_BCAST_DROP) {
+            sub->active = 0;
+        } else {
+            sub->lost += oldest + 1 - sub->seq;
+            sub->seq = oldest + 1;
+        }
+    }
+
+    /* dropped subscribers may be blocked in recv; let them notice */
+    if (b->policy == SMQ_BCAST_DROP)
+        pthread_cond_broadcast(&b->_tdata.condr);
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_bcast_create()
+**
+** Create a broadcast queue. Every message sent is seen by every
+** subscriber which was subscribed at the time of the send.
+**
+** @len: The length of each message.
+** @capacity: The number of slots in the ring; this is how far the
+**  fastest subscriber may run ahead of the slowest one.
+** @policy: SMQ_BCAST_WAIT to have senders wait for the slowest
+**  subscriber, SMQ_BCAST_SKIP to move lagging subscribers forward
+**  (they lose the oldest message) or SMQ_BCAST_DROP to detach them.
+**
+** Returns the SMQB object or NULL on error.
+*/
+SMQB smq_bcast_create(int len, int capacity, int policy) {
+    SMQB b;
+
+    if (len <= 0 || capacity <= 0)
+        return NULL;
+    if (policy != SMQ_BCAST_WAIT && policy != SMQ_BCAST_SKIP && policy != SMQ_BCAST_DROP)
+        return NULL;
+
+    if (!(b = calloc(1, sizeof(*b))))
+        return NULL;
+
+    /* keep each slot aligned for whatever the caller stores */
+    b->slot_size = (int)((sizeof(struct timeval) + len + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+    if (!(b->slots = calloc(capacity, b->slot_size))) {
+        free (b);
+        return NULL;
+    }
+
+    b->len = len;
+    b->capacity = capacity;
+    b->policy = policy;
+    b->head = 0;
+    pthread_mutex_init(&b->_tdata.lock, NULL);
+    pthread_cond_init(&b->_tdata.condr, NULL);
+    pthread_cond_init(&b->_tdata.condw, NULL);
+    return b;
+}
+
+/*
+** smq_bcast_subscribe()
+**
+** Attach a new subscriber. The subscriber sees every message sent
+** after this call.
+**
+** Returns the subscriber or NULL on error.
+*/
+SMQBSub smq_bcast_subscribe(SMQB b) {
+    SMQBSub sub;
+
+    if (!(sub = calloc(1, sizeof(*sub))))
+        return NULL;
+    sub->b = b;
+    sub->active = 1;
+
+    pthread_mutex_lock(&b->_tdata.lock);
+
+    if (b->nsubs == b->maxsubs) {
+        int maxsubs = b->maxsubs ? b->maxsubs * 2 : 8;
+        SMQBSub *subs;
+
+        if (!(subs = realloc(b->subs, sizeof(*subs) * maxsubs))) {
+            pthread_mutex_unlock(&b->_tdata.lock);
+            free (sub);
+            return NULL;
+        }
+        b->subs = subs;
+        b->maxsubs = maxsubs;
+    }
+
+    sub->seq = b->head;
+    b->subs[b->nsubs++] = sub;
+
+    pthread_mutex_unlock(&b->_tdata.lock);
+    return sub;
+}
+
+/*
+** smq_bcast_unsubscribe()
+**
+** Detach and free a subscriber. Writers waiting on this subscriber
+** are released.
+*/
+void smq_bcast_unsubscribe(SMQBSub sub) {
+    SMQB b = sub->b;
+    int i;
+
+    pthread_mutex_lock(&b->_tdata.lock);
+    for (i = 0; i < b->nsubs; i++) {
+        if (b->subs[i] == sub) {
+            b->subs[i] = b->subs[--b->nsubs];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&b->_tdata.condw);
+    pthread_mutex_unlock(&b->_tdata.lock);
+
+    free (sub);
+}
+
+/*
+** smq_bcast_send()
+**
+** Write a message once into the ring for all subscribers.
+**
+** @b: The broadcast queue.
+** @data: The message; must be ``len'' bytes as given to
+**  smq_bcast_create(). NULL is an error.
+** @wait_ms: Only used with SMQ_BCAST_WAIT when the ring is full; same
+**  meaning as for smq_send().
+**
+** Returns: 0 on success, < 0 on error.
+*/
+int smq_bcast_send(SMQB b, void *data, int wait_ms) {
+    struct timespec abstime, *_abstime = NULL;
+    char *slot;
+
+    if (!data)
+        return -1;
+
+    if (wait_ms > 0) {
+        _smq_timeout_time(&abstime, wait_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&b->_tdata.lock);
+
+    while (b->head - _smq_bcast_min(b) >= (unsigned long long)b->capacity) {
+        if (b->policy != SMQ_BCAST_WAIT) {
+            _smq_bcast_make_room(b);
+            break;
+        }
+        if (wait_ms == 0 || _smq_bcast_wait(b, SMQ_SIG_WRITE, _abstime)) {
+            pthread_mutex_unlock(&b->_tdata.lock);
+            return -1;
+        }
+    }
+
+    slot = _smq_bcast_slot(b, b->head);
+    gettimeofday((struct timeval *)slot, NULL);
+    memcpy(slot + sizeof(struct timeval), data, b->len);
+    b->head++;
+
+    /* every subscriber needs to see this one */
+    pthread_cond_broadcast(&b->_tdata.condr);
+
+    pthread_mutex_unlock(&b->_tdata.lock);
+    return 0;
+}
+
+/*
+** smq_bcast_recv()
+**
+** Receive the next message for a subscriber.
+**
+** @sub: The subscriber.
+** @data: Where to copy the message (``len'' bytes). May be NULL to
+**  skip over the message.
+** @tv: If not NULL, receives the time the message was sent.
+** @timeout_ms: Same meaning as for smq_recv().
+**
+** Returns > 0 if a message was received, 0 if none was available in
+** time, and < 0 if the subscriber was dropped (SMQ_BCAST_DROP).
+*/
+int smq_bcast_recv(SMQBSub sub, void *data, struct timeval *tv, int timeout_ms) {
+    SMQB b = sub->b;
+    struct timespec abstime, *_abstime = NULL;
+    int retval = 0;
+
+    if (timeout_ms > 0) {
+        _smq_timeout_time(&abstime, timeout_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&b->_tdata.lock);
+
+    for (; /* break inside */ ;) {
+        if (!sub->active) {
+            retval = -1;
+            break;
+        }
+        if (sub->seq < b->head) {
+            char *slot = _smq_bcast_slot(b, sub->seq);
+
+            if (tv)
+                memcpy(tv, slot, sizeof(*tv));
+            if (data)
+                memcpy(data, slot + sizeof(struct timeval), b->len);
+
+            /*
+            ** If we were a full ring behind we may have been what was
+            ** holding a writer back.
+            */
+            if (b->head - sub->seq >= (unsigned long long)b->capacity)
+                pthread_cond_signal(&b->_tdata.condw);
+
+            sub->seq++;
+            retval = 1;
+            break;
+        }
+        if (timeout_ms == 0 || _smq_bcast_wait(b, SMQ_SIG_READ, _abstime))
+            break;
+    }
+
+    pthread_mutex_unlock(&b->_tdata.lock);
+    return retval;
+}
+
+/*
+** smq_bcast_get_count()
+**
+** Returns the number of messages waiting to be read by a subscriber.
+*/
+int smq_bcast_get_count(SMQBSub sub) {
+    SMQB b = sub->b;
+    int count;
+
+    pthread_mutex_lock(&b->_tdata.lock);
+    count = sub->active ? (int)(b->head - sub->seq) : 0;
+    pthread_mutex_unlock(&b->_tdata.lock);
+    return count;
+}
+
+/*
+** smq_bcast_destroy()
+**
+** Destroy a broadcast queue and every subscriber still attached. No
+** thread may be using the queue or any of its subscribers.
+*/
+int smq_bcast_destroy(SMQB b) {
+    int i;
+
+    for (i = 0; i < b->nsubs; i++)
+        free (b->subs[i]);
+    free (b->subs);
+    free (b->slots);
+    pthread_cond_destroy(&b->_tdata.condr);
+    pthread_cond_destroy(&b->_tdata.condw);
+    pthread_mutex_destroy(&b->_tdata.lock);
+    free (b);
+    return 0;
+}
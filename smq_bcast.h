@@ -0,0 +1,99 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_BCAST_H__
+#define __SMQ_BCAST_H__
+
+/*
+** What a send does when the ring is full because one or more
+** subscribers have not yet read the oldest message.
+*/
+#define SMQ_BCAST_WAIT  0   /* wait (per wait_ms) for the slowest subscriber */
+#define SMQ_BCAST_SKIP  1   /* move lagging subscribers past the oldest message */
+#define SMQ_BCAST_DROP  2   /* detach lagging subscribers */
+
+typedef struct st_smq_bcast_sub {
+    struct st_smq_bcast *b;
+
+    /*
+    ** Sequence number of the next message this subscriber reads
+    */
+    unsigned long long seq;
+
+    /*
+    ** Messages this subscriber missed under SMQ_BCAST_SKIP
+    */
+    unsigned long long lost;
+
+    /*
+    ** Cleared when detached under SMQ_BCAST_DROP
+    */
+    int active;
+} *SMQBSub;
+
+typedef struct st_smq_bcast {
+    /*
+    ** The length of each message
+    */
+    int len;
+
+    /*
+    ** Number of slots in the ring
+    */
+    int capacity;
+
+    /*
+    ** SMQ_BCAST_WAIT, SMQ_BCAST_SKIP or SMQ_BCAST_DROP
+    */
+    int policy;
+
+    /*
+    ** Sequence number of the next message written. Slot for a sequence
+    ** is (seq % capacity).
+    */
+    unsigned long long head;
+
+    /*
+    ** Slot storage; each slot is a struct timeval followed by ``len''
+    ** bytes, padded to slot_size.
+    */
+    char *slots;
+    int slot_size;
+
+    SMQBSub *subs;
+    int nsubs, maxsubs;
+
+    struct {
+        pthread_mutex_t lock;
+
+        /*
+        ** Broadcast to subscribers when a message is written
+        */
+        pthread_cond_t condr;
+
+        /*
+        ** Signalled to writers when the slowest subscriber advances
+        */
+        pthread_cond_t condw;
+    } _tdata;
+} *SMQB;
+
+
+extern SMQB smq_bcast_create(int, int, int);
+extern SMQBSub smq_bcast_subscribe(SMQB);
+extern void smq_bcast_unsubscribe(SMQBSub);
+extern int smq_bcast_send(SMQB, void *, int);
+extern int smq_bcast_recv(SMQBSub, void *, struct timeval *, int);
+extern int smq_bcast_get_count(SMQBSub);
+extern int smq_bcast_destroy(SMQB);
+
+
+#endif /* __SMQ_BCAST_H__ */
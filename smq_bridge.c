@@ -0,0 +1,444 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Bridge a queue to a pipe or stream (e.g. UNIX) socket so that another
+** process can consume it. Each message is framed as a 32 bit length in
+** host byte order followed by the payload; both ends are expected to be
+** on the same host.
+**
+** The sending side drains the queue in batches with smq_recv_batch()
+** and writes a whole batch of frames with one writev() (sendmsg() for
+** sockets, so that a closed peer is an error rather than SIGPIPE). The
+** receiving side reads as much of the stream as is available, cuts it
+** into frames and queues them with smq_send_batch().
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "smq_bridge.h"
+#include "vsmq.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT    0
+#endif
+
+/*
+** How often (ms) a bridge waiting on its descriptor checks for stop
+*/
+#define SMQ_BRIDGE_POLL_MS  100
+
+/*
+** How long (ms) a draining stop waits on a peer which takes nothing
+** before giving up with ETIMEDOUT
+*/
+#define SMQ_BRIDGE_STALL_MS 5000
+
+/*
+** _smq_bridge_stopped()
+**
+** Whether smq_bridge_stop() has been called; with ``nodrain'' set, only
+** if it was called without drain.
+*/
+static int _smq_bridge_stopped(SMQBridge b, int nodrain) {
+    if (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE))
+        return 0;
+    return !nodrain || !__atomic_load_n(&b->drain, __ATOMIC_RELAXED);
+}
+
+/*
+** _smq_bridge_wait_fd()
+**
+** Wait until ``fd'' is ready for ``events'' or SMQ_BRIDGE_POLL_MS has
+** passed. Returns > 0 when ready, 0 on timeout, < 0 on error.
+*/
+static int _smq_bridge_wait_fd(int fd, short events) {
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    if ((r = poll(&pfd, 1, SMQ_BRIDGE_POLL_MS)) < 0 && errno == EINTR)
+        return 0;
+    return r;
+}
+
+/*
+** _smq_bridge_writev()
+**
+** Write all of ``iov'' (modifying it as it goes), however many calls
+** that takes. A peer which stops reading is given up on once the bridge
+** is stopped: at once without drain, after SMQ_BRIDGE_STALL_MS with it.
+** Returns 0, or -1 (with the error, if any, in the stats).
+*/
+static int _smq_bridge_writev(SMQBridge b, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    int stalls = 0;
+    ssize_t r;
+
+    while (iovcnt > 0) {
+        if (b->sock) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            if ((r = sendmsg(b->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == ENOTSOCK) {
+                b->sock = 0;
+                continue;
+            }
+        } else
+            r = writev(b->fd, iov, iovcnt);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (_smq_bridge_wait_fd(b->fd, POLLOUT) > 0)
+                    continue;
+                if (_smq_bridge_stopped(b, 1))
+                    return -1;
+                if (_smq_bridge_stopped(b, 0) &&
+                    ++stalls >= SMQ_BRIDGE_STALL_MS / SMQ_BRIDGE_POLL_MS) {
+                    b->stats.error = ETIMEDOUT;
+                    return -1;
+                }
+                continue;
+            }
+            b->stats.error = errno;
+            return -1;
+        }
+        b->stats.syscalls++;
+        b->stats.bytes += (unsigned long long)r;
+
+        /* skip what was written; a partial write may end mid-buffer */
+        while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+            r -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= (size_t)r;
+        }
+    }
+    return 0;
+}
+
+/*
+** _smq_bridge_writer()
+**
+** Thread for smq_bridge_out(): queue to descriptor.
+*/
+static void *_smq_bridge_writer(void *_b) {
+    SMQBridge b = _b;
+    struct iovec iov[SMQ_BRIDGE_BATCH * 2];
+    uint32_t lens[SMQ_BRIDGE_BATCH];
+    vSMQ_WRAP *wrap;
+    char *msgs;
+    int i, n, stopped;
+
+    if (!(msgs = malloc((size_t)SMQ_BRIDGE_BATCH * b->q->len))) {
+        b->stats.error = ENOMEM;
+        return NULL;
+    }
+    wrap = (vSMQ_WRAP *)msgs;
+
+    for (;;) {
+        if (_smq_bridge_stopped(b, 1))
+            break;
+
+        /* once stopping, only send what is left without waiting */
+        stopped = _smq_bridge_stopped(b, 0);
+        n = smq_recv_batch(b->q, msgs, NULL, SMQ_BRIDGE_BATCH, stopped ? 0 : -1, &b->stop);
+        if (n <= 0) {
+            if (stopped || _smq_bridge_stopped(b, 0))
+                break;
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (b->flags & SMQ_BRIDGE_VSMQ) {
+                /* out of memory or corrupt: the batch is lost, say so and stop */
+                if (vsmq_unwrap(&wrap[i]) < 0) {
+                    b->stats.error = errno;
+                    break;
+                }
+                lens[i] = (uint32_t)wrap[i].sz;
+                iov[i * 2 + 1].iov_base = wrap[i].ptr;
+            } else {
+                lens[i] = (uint32_t)b->q->len;
+                iov[i * 2 + 1].iov_base = msgs + (size_t)i * b->q->len;
+            }
+            iov[i * 2].iov_base = &lens[i];
+            iov[i * 2].iov_len = sizeof(lens[i]);
+            iov[i * 2 + 1].iov_len = lens[i];
+        }
+
+        if (!b->stats.error && _smq_bridge_writev(b, iov, n * 2) == 0)
+            b->stats.messages += (unsigned long long)n;
+
+        /* the payloads were ours to free either way */
+        if (b->flags & SMQ_BRIDGE_VSMQ) {
+            for (i = 0; i < n; i++)
+                free (wrap[i].ptr);
+        }
+
+        if (b->stats.error)
+            break;
+    }
+
+    free (msgs);
+    return NULL;
+}
+
+/*
+** _smq_bridge_flush()
+**
+** Queue the ``n'' messages gathered by the reader in one go. A full
+** queue is waited on SMQ_BRIDGE_POLL_MS at a time, so that a stop
+** without drain gives up (dropping what is left) rather than hang.
+*/
+static void _smq_bridge_flush(SMQBridge b, char *msgs, int n) {
+    vSMQ_WRAP *wrap = (vSMQ_WRAP *)msgs;
+    int sent = 0, r;
+
+    while (sent < n) {
+        r = smq_send_batch(b->q, msgs + (size_t)sent * b->q->len, n - sent, SMQ_BRIDGE_POLL_MS);
+        if (r < 0)
+            break;
+        sent += r;
+        if (sent < n && _smq_bridge_stopped(b, 1))
+            break;
+    }
+    b->stats.messages += (unsigned long long)sent;
+
+    /* whatever could not be queued still owns its payload */
+    if (b->flags & SMQ_BRIDGE_VSMQ) {
+        for (; sent < n; sent++)
+            free (wrap[sent].ptr);
+    }
+}
+
+/*
+** _smq_bridge_reader()
+**
+** Thread for smq_bridge_in(): descriptor to queue.
+*/
+static void *_smq_bridge_reader(void *_b) {
+    SMQBridge b = _b;
+    size_t cap = 64 * 1024, have = 0, off, want;
+    vSMQ_WRAP *wrap;
+    char *buf, *msgs, *nbuf;
+    uint32_t len;
+    ssize_t r;
+    int n;
+
+    buf = malloc(cap);
+    msgs = malloc((size_t)SMQ_BRIDGE_BATCH * b->q->len);
+    if (!buf || !msgs) {
+        b->stats.error = ENOMEM;
+        goto out;
+    }
+    wrap = (vSMQ_WRAP *)msgs;
+
+    for (;;) {
+        if (_smq_bridge_stopped(b, 1))
+            break;
+
+        if ((r = _smq_bridge_wait_fd(b->fd, POLLIN)) == 0)
+            continue;
+        if (r > 0)
+            r = read(b->fd, buf + have, cap - have);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            b->stats.error = errno;
+            break;
+        }
+        /* end of stream */
+        if (r == 0)
+            break;
+        b->stats.syscalls++;
+        b->stats.bytes += (unsigned long long)r;
+        have += (size_t)r;
+
+        /* cut out every complete frame */
+        for (off = 0, n = 0; have - off >= sizeof(len); ) {
+            memcpy(&len, buf + off, sizeof(len));
+            if (len > SMQ_BRIDGE_MAX_FRAME ||
+                (!(b->flags & SMQ_BRIDGE_VSMQ) && len != (uint32_t)b->q->len)) {
+                b->stats.error = EPROTO;
+                break;
+            }
+            if (have - off - sizeof(len) < len)
+                break;
+
+            if (b->flags & SMQ_BRIDGE_VSMQ) {
+                /* vsmq_send() does not take empty messages; neither do we */
+                /* one extra byte so that strings arrive terminated, as with vsmq_send() */
+                if (len) {
+                    if (!(wrap[n].ptr = malloc((size_t)len + 1))) {
+                        b->stats.error = ENOMEM;
+                        break;
+                    }
+                    memcpy(wrap[n].ptr, buf + off + sizeof(len), len);
+                    ((char *)wrap[n].ptr)[len] = 0;
+                    wrap[n].csz = 0;
+                    wrap[n++].sz = (int)len;
+                }
+            } else
+                memcpy(msgs + (size_t)n++ * b->q->len, buf + off + sizeof(len), len);
+            off += sizeof(len) + len;
+
+            if (n == SMQ_BRIDGE_BATCH) {
+                _smq_bridge_flush(b, msgs, n);
+                n = 0;
+            }
+        }
+        _smq_bridge_flush(b, msgs, n);
+        if (b->stats.error)
+            break;
+
+        /* keep the partial frame; make room for it if it is a big one */
+        memmove(buf, buf + off, have - off);
+        have -= off;
+        if (have >= sizeof(len)) {
+            memcpy(&len, buf, sizeof(len));
+            want = sizeof(len) + len;
+            if (want > cap) {
+                if (!(nbuf = realloc(buf, want))) {
+                    b->stats.error = ENOMEM;
+                    break;
+                }
+                buf = nbuf;
+                cap = want;
+            }
+        }
+    }
+
+out:
+    free (msgs);
+    free (buf);
+    return NULL;
+}
+
+/*
+** _smq_bridge_start()
+**
+** Allocate a bridge and start its thread.
+*/
+static SMQBridge _smq_bridge_start(SMQ q, int fd, int flags, void *(*fn)(void *)) {
+    SMQBridge b;
+
+    if (!q || fd < 0)
+        return NULL;
+    if ((flags & SMQ_BRIDGE_VSMQ) && q->len != (int)sizeof(vSMQ_WRAP))
+        return NULL;
+
+    if (!(b = calloc(1, sizeof(*b))))
+        return NULL;
+    b->q = q;
+    b->fd = fd;
+    b->flags = flags;
+    b->sock = 1;
+
+    if (pthread_create(&b->tid, NULL, fn, b)) {
+        free (b);
+        return NULL;
+    }
+    return b;
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_bridge_out()
+**
+** Start forwarding messages from a queue to a pipe or stream socket.
+** A thread drains the queue up to SMQ_BRIDGE_BATCH messages at a time
+** and writes each batch of length-prefixed frames with a single
+** writev()/sendmsg(). When writing to a pipe, ignore SIGPIPE or a
+** vanished reader will end the process, and make the pipe non-blocking
+** (O_NONBLOCK) so that a reader which stops reading cannot hold up
+** smq_bridge_stop(); sockets are written without blocking anyway.
+**
+** @q: The SMQ or vSMQ to drain. Nothing else should receive from it.
+** @fd: The descriptor to write to; remains the caller's to close.
+** @flags: SMQ_BRIDGE_VSMQ if q is a vSMQ, otherwise 0.
+**
+** Returns the bridge or NULL on error.
+*/
+SMQBridge smq_bridge_out(SMQ q, int fd, int flags) {
+    return _smq_bridge_start(q, fd, flags, _smq_bridge_writer);
+}
+
+/*
+** smq_bridge_in()
+**
+** Start queueing messages read from a pipe or stream socket written by
+** smq_bridge_out() (or anything producing the same framing). A thread
+** reads as much as is available at once and queues the complete frames
+** with smq_send_batch(). It stops at end of stream or on a malformed
+** frame (for an SMQ, every frame must be exactly ``len'' bytes).
+**
+** @q: The SMQ or vSMQ to send into.
+** @fd: The descriptor to read from; remains the caller's to close.
+** @flags: SMQ_BRIDGE_VSMQ if q is a vSMQ, otherwise 0.
+**
+** Returns the bridge or NULL on error.
+*/
+SMQBridge smq_bridge_in(SMQ q, int fd, int flags) {
+    return _smq_bridge_start(q, fd, flags, _smq_bridge_reader);
+}
+
+/*
+** smq_bridge_stop()
+**
+** Stop a bridge, wait for its thread and free it. The descriptor is
+** left open.
+**
+** @b: The bridge.
+** @drain: For smq_bridge_out(), write everything still queued before
+**  stopping; for smq_bridge_in(), keep reading until end of stream
+**  (i.e. wait for the writer to finish and close its end), waiting
+**  for room in a full queue as long as that takes. Otherwise stop
+**  after the current batch; an incoming bridge drops whatever of it
+**  finds no room within SMQ_BRIDGE_POLL_MS.
+** @stats: If not NULL, receives the bridge's final statistics.
+**
+** Returns 0, or -1 if the bridge ended because of an error.
+*/
+int smq_bridge_stop(SMQBridge b, int drain, SMQBridgeStats *stats) {
+    int retval;
+
+    __atomic_store_n(&b->drain, drain, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+    smq_wakeup(b->q);
+    pthread_join(b->tid, NULL);
+
+    retval = b->stats.error ? -1 : 0;
+    if (stats)
+        *stats = b->stats;
+    free (b);
+    return retval;
+}
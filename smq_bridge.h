@@ -0,0 +1,78 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_BRIDGE_H__
+#define __SMQ_BRIDGE_H__
+
+/*
+** Flags for smq_bridge_out() and smq_bridge_in()
+*/
+#define SMQ_BRIDGE_VSMQ     0x01    /* the queue is a vSMQ */
+
+/*
+** Messages (at most) moved per system call batch
+*/
+#define SMQ_BRIDGE_BATCH    64
+
+/*
+** Largest frame accepted by smq_bridge_in()
+*/
+#define SMQ_BRIDGE_MAX_FRAME    (64 * 1024 * 1024)
+
+typedef struct st_smq_bridge_stats {
+    unsigned long long messages;
+    unsigned long long bytes;
+
+    /*
+    ** writev()/sendmsg() or read() calls made
+    */
+    unsigned long long syscalls;
+
+    /*
+    ** errno of the failure which ended the bridge (EPROTO for a bad
+    ** frame), or 0
+    */
+    int error;
+} SMQBridgeStats;
+
+typedef struct st_smq_bridge {
+    SMQ q;
+    int fd;
+    int flags;
+
+    /*
+    ** Cleared once sendmsg() finds ``fd'' is not a socket (a pipe);
+    ** writev() is used from then on.
+    */
+    int sock;
+
+    /*
+    ** Set by smq_bridge_stop(); see there for ``drain''. Accessed
+    ** atomically.
+    */
+    int stop;
+    int drain;
+
+    /*
+    ** Only written by the bridge thread
+    */
+    SMQBridgeStats stats;
+
+    pthread_t tid;
+} *SMQBridge;
+
+
+extern SMQBridge smq_bridge_out(SMQ, int, int);
+extern SMQBridge smq_bridge_in(SMQ, int, int);
+extern int smq_bridge_stop(SMQBridge, int, SMQBridgeStats *);
+
+
+#endif /* __SMQ_BRIDGE_H__ */
@@ -0,0 +1,451 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Callback-driven consumer pool. Replaces the usual loop of N threads
+** each calling smq_recv() and handling one message at a time: workers
+** take batches with smq_recv_batch() and hand them to a handler.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include "smq_consume.h"
+#include "smq_util.h"
+
+/*
+** _smq_consume_pin()
+**
+** Pin the calling thread to ``cpu''. Only supported on Linux; a
+** failure simply leaves the thread unpinned.
+*/
+static void _smq_consume_pin(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+/*
+** _smq_consume_now_ns()
+**
+** Monotonic time in nanoseconds, as kept in SMQWorker.last_busy. Never
+** 0, which last_busy reserves for ``inside the handler''.
+*/
+static long long _smq_consume_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec + 1;
+}
+
+/*
+** _smq_consume_busy()
+**
+** Read or set a worker's last_busy; it is written by the worker and
+** read by the monitor without the consumer lock.
+*/
+static long long _smq_consume_busy(SMQWorker *w) {
+    return __atomic_load_n(&w->last_busy, __ATOMIC_RELAXED);
+}
+
+static void _smq_consume_set_busy(SMQWorker *w, long long ns) {
+    __atomic_store_n(&w->last_busy, ns, __ATOMIC_RELAXED);
+}
+
+/*
+** _smq_consume_flag() / _smq_consume_set_flag()
+**
+** Read or set one of the stop, drain or quit flags. They are read
+** without the consumer lock (quit is also the smq_recv_batch()
+** interrupt), so always atomically. smq_consume_stop() writes drain, stop
+** and then quit, so a worker seeing quit also sees the other two.
+*/
+static int _smq_consume_flag(int *flag) {
+    return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static void _smq_consume_set_flag(int *flag, int value) {
+    __atomic_store_n(flag, value, __ATOMIC_RELEASE);
+}
+
+/*
+** _smq_consume_worker()
+**
+** Worker thread. Blocks until messages are available and passes them
+** to the handler in batches of up to max_batch. Leaves when its quit
+** flag is set; if the whole consumer is stopping with drain, it first
+** takes what is left without waiting.
+*/
+static void *_smq_consume_worker(void *_w) {
+    SMQWorker *w = _w;
+    SMQConsumer c = w->c;
+    char *msgs;
+    int n, quit;
+
+    _smq_consume_pin(w->cpu);
+
+    if ((msgs = malloc((size_t)c->max_batch * c->q->len))) {
+        for (;;) {
+            quit = _smq_consume_flag(&w->quit);
+            if (quit && !(_smq_consume_flag(&c->stop) && _smq_consume_flag(&c->drain)))
+                break;
+
+            n = smq_recv_batch(c->q, msgs, NULL, c->max_batch, quit ? 0 : -1, &w->quit);
+            if (n > 0) {
+                _smq_consume_set_busy(w, 0);
+                c->handler(c->q, msgs, n, c->arg);
+                _smq_consume_set_busy(w, _smq_consume_now_ns());
+            }
+            else if (_smq_consume_flag(&w->quit))
+                break;
+        }
+        free (msgs);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    w->state = SMQ_WORKER_EXITED;
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*
+** _smq_consume_start()
+**
+** Start the worker in slot ``i''. Must be called with the consumer lock
+** held (or before any thread is running).
+*/
+static int _smq_consume_start(SMQConsumer c, int i) {
+    SMQWorker *w = &c->workers[i];
+
+    w->c = c;
+    _smq_consume_set_flag(&w->quit, 0);
+    _smq_consume_set_busy(w, _smq_consume_now_ns());
+    w->state = SMQ_WORKER_RUNNING;
+    if (pthread_create(&w->tid, NULL, _smq_consume_worker, w)) {
+        w->state = SMQ_WORKER_UNUSED;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** _smq_consume_default_policy()
+**
+** Add a worker while messages are older than target_age or deeper than
+** target_depth per worker; otherwise retire one idle worker at a time.
+*/
+static int _smq_consume_default_policy(const SMQScaleStats *st, void *arg) {
+    const SMQScaleConfig *cfg = arg;
+
+    if (st->workers < st->min_workers)
+        return st->min_workers - st->workers;
+    if ((cfg->target_age > 0 && st->head_age > cfg->target_age) ||
+        (cfg->target_depth > 0 && st->count > st->workers * cfg->target_depth))
+        return 1;
+    if (st->idle > 0)
+        return -1;
+    return 0;
+}
+
+/*
+** _smq_consume_scale()
+**
+** One sampling step of the monitor, called with the consumer lock held:
+** reap exited workers, ask the policy, then start or retire workers.
+*/
+static void _smq_consume_scale(SMQConsumer c) {
+    SMQScaleConfig *cfg = &c->scale;
+    SMQScaleStats st;
+    SMQWorker *w, *oldest;
+    long long now, busy, oldest_busy = 0, cooldown;
+    int i, delta;
+
+    memset(&st, 0, sizeof(st));
+    st.count = smq_get_count(c->q);
+    st.head_age = smq_get_head_age(c->q);
+    st.min_workers = cfg->min_workers;
+    st.max_workers = cfg->max_workers;
+
+    now = _smq_consume_now_ns();
+    cooldown = (long long)(cfg->cooldown * 1000000000.0);
+    for (i = 0; i < c->nthreads; i++) {
+        w = &c->workers[i];
+        if (w->state == SMQ_WORKER_EXITED) {
+            pthread_join(w->tid, NULL);
+            w->state = SMQ_WORKER_UNUSED;
+        }
+        if (w->state != SMQ_WORKER_RUNNING || _smq_consume_flag(&w->quit))
+            continue;
+        st.workers++;
+        busy = _smq_consume_busy(w);
+        if (busy && now - busy >= cooldown)
+            st.idle++;
+    }
+
+    if (cfg->policy)
+        delta = cfg->policy(&st, cfg->policy_arg);
+    else
+        delta = _smq_consume_default_policy(&st, cfg);
+
+    if (st.workers + delta > cfg->max_workers)
+        delta = cfg->max_workers - st.workers;
+    if (st.workers + delta < cfg->min_workers)
+        delta = cfg->min_workers - st.workers;
+    if (delta < -st.idle)
+        delta = -st.idle;
+
+    for (i = 0; i < c->nthreads && delta > 0; i++) {
+        if (c->workers[i].state == SMQ_WORKER_UNUSED && _smq_consume_start(c, i) == 0)
+            delta--;
+    }
+
+    /* retire the longest idle workers first */
+    for (; delta < 0; delta++) {
+        oldest = NULL;
+        for (i = 0; i < c->nthreads; i++) {
+            w = &c->workers[i];
+            if (w->state != SMQ_WORKER_RUNNING || _smq_consume_flag(&w->quit))
+                continue;
+            busy = _smq_consume_busy(w);
+            if (!busy || now - busy < cooldown)
+                continue;
+            if (!oldest || busy < oldest_busy) {
+                oldest = w;
+                oldest_busy = busy;
+            }
+        }
+        if (!oldest)
+            break;
+        _smq_consume_set_flag(&oldest->quit, 1);
+        smq_wakeup(c->q);
+    }
+}
+
+/*
+** _smq_consume_monitor()
+**
+** Monitor thread of an elastic consumer; samples the queue every
+** interval_ms until the consumer is stopped.
+*/
+static void *_smq_consume_monitor(void *_c) {
+    SMQConsumer c = _c;
+    struct timespec abstime;
+
+    pthread_mutex_lock(&c->lock);
+    while (!_smq_consume_flag(&c->stop)) {
+        _smq_timeout_time(&abstime, c->scale.interval_ms);
+        pthread_cond_timedwait(&c->cond, &c->lock, &abstime);
+        if (_smq_consume_flag(&c->stop))
+            break;
+        _smq_consume_scale(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*
+** _smq_consume_new()
+**
+** Allocate a consumer with ``nthreads'' (unused) worker slots.
+*/
+static SMQConsumer _smq_consume_new(SMQ q, SMQHandler handler, void *arg, int nthreads,
+    int max_batch) {
+    SMQConsumer c;
+
+    if (!(c = calloc(1, sizeof(*c))))
+        return NULL;
+    c->q = q;
+    c->handler = handler;
+    c->arg = arg;
+    c->nthreads = nthreads;
+    c->max_batch = max_batch;
+
+    if (!(c->workers = calloc(nthreads, sizeof(*c->workers)))) {
+        free (c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    return c;
+}
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_consume()
+**
+** Start a pool of worker threads consuming from a queue.
+**
+** @q: The SMQ (or vSMQ) object to consume.
+** @handler: Called with each batch of messages; see SMQHandler.
+** @arg: Passed through to the handler.
+** @nthreads: Number of worker threads.
+** @max_batch: The most messages passed to a single handler call.
+** @cpus: NULL, or an array of ``nthreads'' CPU numbers to pin each
+**  worker to (-1 for no pinning of that worker).
+**
+** Returns the consumer object, or NULL on error.
+*/
+SMQConsumer smq_consume(SMQ q, SMQHandler handler, void *arg, int nthreads, int max_batch,
+    const int *cpus) {
+    SMQConsumer c;
+    int i;
+
+    if (!q || !handler || nthreads <= 0 || max_batch <= 0)
+        return NULL;
+
+    if (!(c = _smq_consume_new(q, handler, arg, nthreads, max_batch)))
+        return NULL;
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < nthreads; i++) {
+        c->workers[i].cpu = cpus ? cpus[i] : -1;
+        if (_smq_consume_start(c, i)) {
+            /* stop what we started so far */
+            pthread_mutex_unlock(&c->lock);
+            smq_consume_stop(c, 0);
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return c;
+}
+
+/*
+** smq_consume_elastic()
+**
+** Start a consumer pool whose size follows the load. A monitor thread
+** samples the queue depth and the age of the oldest message every
+** interval and adds workers (up to max_workers) while the queue falls
+** behind, retiring workers (down to min_workers) once they have been
+** idle for the cooldown.
+**
+** @q: The SMQ (or vSMQ) object to consume.
+** @handler: Called with each batch of messages; see SMQHandler.
+** @arg: Passed through to the handler.
+** @max_batch: The most messages passed to a single handler call.
+** @cfg: Scaling limits, targets and optional policy; see SMQScaleConfig.
+**  Copied, so it need not outlive the call.
+**
+** Returns the consumer object, or NULL on error.
+*/
+SMQConsumer smq_consume_elastic(SMQ q, SMQHandler handler, void *arg, int max_batch,
+    const SMQScaleConfig *cfg) {
+    SMQConsumer c;
+    int i;
+
+    if (!q || !handler || !cfg || max_batch <= 0 || cfg->min_workers < 0 ||
+        cfg->max_workers <= 0 || cfg->min_workers > cfg->max_workers || cfg->interval_ms <= 0)
+        return NULL;
+
+    if (!(c = _smq_consume_new(q, handler, arg, cfg->max_workers, max_batch)))
+        return NULL;
+    c->elastic = 1;
+    c->scale = *cfg;
+    c->scale.cpus = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < c->nthreads; i++)
+        c->workers[i].cpu = cfg->cpus ? cfg->cpus[i] : -1;
+    for (i = 0; i < cfg->min_workers; i++) {
+        if (_smq_consume_start(c, i))
+            break;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (i < cfg->min_workers || pthread_create(&c->monitor, NULL, _smq_consume_monitor, c)) {
+        c->elastic = 0;
+        smq_consume_stop(c, 0);
+        return NULL;
+    }
+
+    return c;
+}
+
+/*
+** smq_consume_get_workers()
+**
+** Return the number of workers currently running (not counting any
+** being retired).
+**
+** @c: The consumer.
+*/
+int smq_consume_get_workers(SMQConsumer c) {
+    int i, n = 0;
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < c->nthreads; i++) {
+        if (c->workers[i].state == SMQ_WORKER_RUNNING && !_smq_consume_flag(&c->workers[i].quit))
+            n++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
+
+/*
+** smq_consume_stop()
+**
+** Stop the workers, wait for them to exit and free the consumer. The
+** queue itself is left alone.
+**
+** @c: The consumer returned by smq_consume() or smq_consume_elastic().
+** @drain: If non-zero, workers keep handling messages until the queue
+**  is empty; otherwise they leave after their current batch and
+**  anything still queued stays in the queue.
+**
+** Returns 0.
+*/
+int smq_consume_stop(SMQConsumer c, int drain) {
+    int i, started;
+
+    pthread_mutex_lock(&c->lock);
+    _smq_consume_set_flag(&c->drain, drain);
+    _smq_consume_set_flag(&c->stop, 1);
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    /* no more workers are started once the monitor is gone */
+    if (c->elastic)
+        pthread_join(c->monitor, NULL);
+
+    for (i = 0; i < c->nthreads; i++)
+        _smq_consume_set_flag(&c->workers[i].quit, 1);
+    smq_wakeup(c->q);
+
+    for (i = 0; i < c->nthreads; i++) {
+        pthread_mutex_lock(&c->lock);
+        started = c->workers[i].state != SMQ_WORKER_UNUSED;
+        pthread_mutex_unlock(&c->lock);
+        if (started)
+            pthread_join(c->workers[i].tid, NULL);
+    }
+
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free (c->workers);
+    free (c);
+    return 0;
+}
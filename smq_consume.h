@@ -0,0 +1,158 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_CONSUME_H__
+#define __SMQ_CONSUME_H__
+
+/*
+** Called by a worker with ``n'' messages (n * len bytes, in queue order)
+** taken from the queue in one go. For a vSMQ, msgs is an array of
+** vSMQ_WRAP whose ``ptr'' the handler must free(); if the vSMQ
+** compresses (vsmq_set_compression()), call vsmq_unwrap() on each first.
+*/
+typedef void (*SMQHandler)(SMQ q, void *msgs, int n, void *arg);
+
+/*
+** What an elastic consumer's scaling policy gets to look at each
+** sampling interval.
+*/
+typedef struct st_smq_scale_stats {
+    /*
+    ** Queue depth and age (seconds) of the oldest message
+    */
+    int count;
+    double head_age;
+
+    /*
+    ** Workers running, and how many of those have been idle for at
+    ** least the cooldown
+    */
+    int workers;
+    int idle;
+
+    int min_workers;
+    int max_workers;
+} SMQScaleStats;
+
+/*
+** A scaling policy returns the number of workers to add (> 0) or retire
+** (< 0); the result is clamped to [min_workers, max_workers] and only
+** idle workers are retired.
+*/
+typedef int (*SMQScalePolicy)(const SMQScaleStats *, void *arg);
+
+typedef struct st_smq_scale_config {
+    int min_workers;
+    int max_workers;
+
+    /*
+    ** Add a worker when the oldest message is older than target_age
+    ** seconds, or the depth exceeds target_depth per worker. Either may
+    ** be 0 to ignore it.
+    */
+    double target_age;
+    int target_depth;
+
+    /*
+    ** Seconds a worker must have been idle before it may be retired
+    */
+    double cooldown;
+
+    /*
+    ** How often the queue is sampled, in milliseconds
+    */
+    int interval_ms;
+
+    /*
+    ** Optional custom policy replacing the rules above
+    */
+    SMQScalePolicy policy;
+    void *policy_arg;
+
+    /*
+    ** NULL, or max_workers CPU numbers (-1 for none) for each worker slot
+    */
+    const int *cpus;
+} SMQScaleConfig;
+
+#define SMQ_WORKER_UNUSED   0
+#define SMQ_WORKER_RUNNING  1
+#define SMQ_WORKER_EXITED   2
+
+typedef struct st_smq_worker {
+    struct st_smq_consumer *c;
+
+    /*
+    ** CPU the worker is pinned to, or -1
+    */
+    int cpu;
+
+    /*
+    ** SMQ_WORKER_*; changed under the consumer lock
+    */
+    int state;
+
+    /*
+    ** Set to make this worker leave (stop or retire). Also the
+    ** interrupt flag for its smq_recv_batch() calls. Accessed
+    ** atomically.
+    */
+    int quit;
+
+    /*
+    ** Monotonic time in nanoseconds the worker last finished a batch
+    ** (or was started); 0 while it is inside the handler. Accessed
+    ** atomically.
+    */
+    long long last_busy;
+
+    pthread_t tid;
+} SMQWorker;
+
+typedef struct st_smq_consumer {
+    SMQ q;
+    SMQHandler handler;
+    void *arg;
+
+    /*
+    ** Number of worker slots and the most messages handed to the
+    ** handler per call
+    */
+    int nthreads;
+    int max_batch;
+
+    /*
+    ** Set by smq_consume_stop(); workers leave when they see it (after
+    ** emptying the queue if ``drain'' is set). Accessed atomically.
+    */
+    int stop;
+    int drain;
+
+    SMQWorker *workers;
+
+    /*
+    ** Elastic consumers only (smq_consume_elastic())
+    */
+    int elastic;
+    SMQScaleConfig scale;
+    pthread_t monitor;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} *SMQConsumer;
+
+
+extern SMQConsumer smq_consume(SMQ, SMQHandler, void *, int, int, const int *);
+extern SMQConsumer smq_consume_elastic(SMQ, SMQHandler, void *, int, const SMQScaleConfig *);
+extern int smq_consume_get_workers(SMQConsumer);
+extern int smq_consume_stop(SMQConsumer, int);
+
+
+#endif /* __SMQ_CONSUME_H__ */
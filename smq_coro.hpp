@@ -0,0 +1,476 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** C++20 coroutine flavour of smq.hpp.
+**
+** smq::async_queue<T, Capacity> uses the same ring storage as
+** smq::queue<T, Capacity> (detail::ring; like smq::queue it is not
+** layered on the C library, see smq.hpp), but instead of blocking a
+** thread in a condition variable, ``co_await q.recv()'' and
+** ``co_await q.send(v)'' suspend the calling coroutine. The coroutine
+** is parked on the queue and posted to the user-supplied executor by
+** whichever thread makes progress possible (a send for a waiting recv
+** and vice versa); it is never resumed inline.
+**
+** Both awaitables accept a timeout in milliseconds (< 0 waits forever,
+** 0 never suspends, > 0 waits that long) and an optional
+** std::stop_token for cancellation. Timeouts and cancellations are
+** detected by a single shared timer thread, which only posts the
+** coroutine to its executor, so no coroutine runs on (and stalls) it.
+**
+**  co_await q.recv(...)     -> std::optional<T>; empty on timeout/cancel
+**  co_await q.send(v, ...)  -> bool; false on timeout/cancel
+*/
+
+#ifndef __SMQ_CORO_HPP__
+#define __SMQ_CORO_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include "smq.hpp"
+
+namespace smq {
+
+namespace detail {
+
+/*
+** timer_service
+**
+** One background thread running callbacks at a deadline. Used for
+** coroutine timeouts and to move cancellations off the thread that
+** requested the stop.
+*/
+class timer_service {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static timer_service &instance() {
+        static timer_service ts;
+        return ts;
+    }
+
+    /*
+    ** add()
+    **
+    ** Run ``fn'' on the timer thread at ``when''. Returns an id for
+    ** expire_now()/cancel().
+    */
+    std::uint64_t add(clock::time_point when, std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::uint64_t id = next_id_++;
+
+        timers_.emplace(key(when, id), std::move(fn));
+        index_.emplace(id, when);
+        cond_.notify_one();
+        return id;
+    }
+
+    /*
+    ** expire_now()
+    **
+    ** Move a pending timer up to now. Does nothing if it already ran.
+    */
+    void expire_now(std::uint64_t id) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto it = index_.find(id);
+
+        if (it == index_.end())
+            return;
+        auto node = timers_.extract(key(it->second, id));
+        it->second = clock::now();
+        node.key() = key(it->second, id);
+        timers_.insert(std::move(node));
+        cond_.notify_one();
+    }
+
+    /*
+    ** cancel()
+    **
+    ** Remove a timer. If its callback is running right now, wait for
+    ** it to return so the caller may safely release what it uses.
+    */
+    void cancel(std::uint64_t id) {
+        std::unique_lock<std::mutex> lock(lock_);
+        auto it = index_.find(id);
+
+        if (it != index_.end()) {
+            timers_.erase(key(it->second, id));
+            index_.erase(it);
+            return;
+        }
+        done_.wait(lock, [this, id] { return running_ != id; });
+    }
+
+private:
+    using key_type = std::pair<clock::time_point, std::uint64_t>;
+
+    static key_type key(clock::time_point when, std::uint64_t id) { return key_type(when, id); }
+
+    timer_service() : thread_([this] { run(); }) { }
+
+    ~timer_service() {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stop_ = true;
+            cond_.notify_one();
+        }
+        thread_.join();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        while (!stop_) {
+            if (timers_.empty()) {
+                cond_.wait(lock);
+                continue;
+            }
+            auto it = timers_.begin();
+            if (it->first.first > clock::now()) {
+                cond_.wait_until(lock, it->first.first);
+                continue;
+            }
+
+            std::function<void()> fn = std::move(it->second);
+            running_ = it->first.second;
+            index_.erase(running_);
+            timers_.erase(it);
+
+            lock.unlock();
+            fn();
+            lock.lock();
+
+            running_ = 0;
+            done_.notify_all();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::condition_variable done_;
+    std::map<key_type, std::function<void()>> timers_;
+    std::unordered_map<std::uint64_t, clock::time_point> index_;
+    std::uint64_t next_id_ = 1;
+    std::uint64_t running_ = 0;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+} /* namespace detail */
+
+/*
+** executor
+**
+** Where suspended coroutines are resumed: a function which posts the
+** handle to be resumed on some thread (e.g. a pool). It is called from
+** whichever thread completes an operation, including the shared timer
+** thread, so it must not resume the handle inline.
+*/
+using executor = std::function<void(std::coroutine_handle<>)>;
+
+template <typename T, std::size_t Capacity>
+class async_queue {
+    enum { PENDING, DONE, EXPIRED };
+
+    struct on_stop {
+        std::uint64_t id;
+        void operator()() const noexcept { detail::timer_service::instance().expire_now(id); }
+    };
+
+    /*
+    ** waiter
+    **
+    ** A suspended coroutine parked on the queue; lives inside the
+    ** awaitable, i.e. in the coroutine frame.
+    */
+    struct waiter {
+        waiter *prev = nullptr, *next = nullptr;
+        std::coroutine_handle<> handle;
+        int state = PENDING;
+        std::uint64_t timer = 0;
+        std::optional<std::stop_callback<on_stop>> stop;
+    };
+
+    struct wait_list {
+        waiter *head = nullptr, *tail = nullptr;
+
+        bool empty() const { return !head; }
+
+        void push(waiter *w) {
+            w->prev = tail;
+            w->next = nullptr;
+            if (tail)
+                tail->next = w;
+            else
+                head = w;
+            tail = w;
+        }
+
+        void remove(waiter *w) {
+            if (w->prev)
+                w->prev->next = w->next;
+            else
+                head = w->next;
+            if (w->next)
+                w->next->prev = w->prev;
+            else
+                tail = w->prev;
+            w->prev = w->next = nullptr;
+        }
+
+        waiter *pop() {
+            waiter *w = head;
+
+            if (w)
+                remove(w);
+            return w;
+        }
+    };
+
+    struct recv_waiter : waiter {
+        std::optional<T> value;
+    };
+
+    struct send_waiter : waiter {
+        T value;
+
+        explicit send_waiter(T &&v) : value(std::move(v)) { }
+    };
+
+public:
+    using value_type = T;
+
+    explicit async_queue(executor exec) : exec_(std::move(exec)) {
+        if (!exec_)
+            throw std::invalid_argument("smq::async_queue: an executor is required");
+    }
+    async_queue(const async_queue &) = delete;
+    async_queue &operator=(const async_queue &) = delete;
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+    /*
+    ** recv_awaitable
+    **
+    ** Result of recv(); co_await yields std::optional<T>.
+    */
+    class recv_awaitable {
+    public:
+        recv_awaitable(async_queue &q, int timeout_ms, std::stop_token st)
+            : q_(q), timeout_ms_(timeout_ms), st_(std::move(st)) { }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::unique_lock<std::mutex> lock(q_.lock_);
+
+            if (q_.take_locked(w_.value, lock))
+                return false;
+            if (timeout_ms_ == 0 || st_.stop_requested())
+                return false;
+            w_.handle = h;
+            q_.park(w_, q_.recvq_, timeout_ms_, st_);
+            return true;
+        }
+
+        std::optional<T> await_resume() { return std::move(w_.value); }
+
+    private:
+        async_queue &q_;
+        int timeout_ms_;
+        std::stop_token st_;
+        recv_waiter w_;
+    };
+
+    /*
+    ** send_awaitable
+    **
+    ** Result of send(); co_await yields true once the value is queued
+    ** (or handed straight to a waiting receiver).
+    */
+    class send_awaitable {
+    public:
+        send_awaitable(async_queue &q, T &&v, int timeout_ms, std::stop_token st)
+            : q_(q), timeout_ms_(timeout_ms), st_(std::move(st)), w_(std::move(v)) { }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::unique_lock<std::mutex> lock(q_.lock_);
+
+            if (q_.give_locked(w_.value, lock)) {
+                w_.state = DONE;
+                return false;
+            }
+            if (timeout_ms_ == 0 || st_.stop_requested())
+                return false;
+            w_.handle = h;
+            q_.park(w_, q_.sendq_, timeout_ms_, st_);
+            return true;
+        }
+
+        bool await_resume() const noexcept { return w_.state == DONE; }
+
+    private:
+        async_queue &q_;
+        int timeout_ms_;
+        std::stop_token st_;
+        send_waiter w_;
+    };
+
+    recv_awaitable recv(int timeout_ms = -1, std::stop_token st = {}) {
+        return recv_awaitable(*this, timeout_ms, std::move(st));
+    }
+
+    send_awaitable send(T v, int timeout_ms = -1, std::stop_token st = {}) {
+        return send_awaitable(*this, std::move(v), timeout_ms, std::move(st));
+    }
+
+    /*
+    ** try_send() / try_recv()
+    **
+    ** Non-suspending versions for plain threads; these still wake
+    ** parked coroutines.
+    */
+    bool try_send(T v) {
+        std::unique_lock<std::mutex> lock(lock_);
+        return give_locked(v, lock);
+    }
+
+    std::optional<T> try_recv() {
+        std::unique_lock<std::mutex> lock(lock_);
+        std::optional<T> out;
+
+        take_locked(out, lock);
+        return out;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return ring_.size();
+    }
+
+private:
+    /*
+    ** give_locked()
+    **
+    ** Hand ``v'' to the oldest parked receiver, or queue it if there is
+    ** room. Always returns with ``lock'' released if a coroutine was
+    ** resumed. Returns false if the queue is full.
+    */
+    bool give_locked(T &v, std::unique_lock<std::mutex> &lock) {
+        if (!recvq_.empty()) {
+            recv_waiter *w = static_cast<recv_waiter *>(recvq_.pop());
+
+            w->value.emplace(std::move(v));
+            w->state = DONE;
+            lock.unlock();
+            complete(w, true);
+            return true;
+        }
+        if (ring_.full())
+            return false;
+        ring_.push_back(std::move(v));
+        return true;
+    }
+
+    /*
+    ** take_locked()
+    **
+    ** Take the oldest element into ``out'' and, if that made room,
+    ** admit the oldest parked sender. Returns false if empty.
+    */
+    bool take_locked(std::optional<T> &out, std::unique_lock<std::mutex> &lock) {
+        if (ring_.empty())
+            return false;
+        out.emplace();
+        ring_.pop_front(*out);
+        if (!sendq_.empty()) {
+            send_waiter *w = static_cast<send_waiter *>(sendq_.pop());
+
+            ring_.push_back(std::move(w->value));
+            w->state = DONE;
+            lock.unlock();
+            complete(w, true);
+        }
+        return true;
+    }
+
+    /*
+    ** park()
+    **
+    ** Add a waiter to a wait list and arm its timeout/cancellation. The
+    ** queue lock is held.
+    */
+    void park(waiter &w, wait_list &list, int timeout_ms, std::stop_token &st) {
+        list.push(&w);
+        if (timeout_ms < 0 && !st.stop_possible())
+            return;
+
+        auto when = timeout_ms < 0 ? detail::timer_service::clock::time_point::max() :
+            detail::timer_service::clock::now() + std::chrono::milliseconds(timeout_ms);
+        waiter *wp = &w;
+        wait_list *lp = &list;
+
+        w.timer = detail::timer_service::instance().add(when, [this, wp, lp] { expire(wp, lp); });
+        if (st.stop_possible())
+            w.stop.emplace(st, on_stop { w.timer });
+    }
+
+    /*
+    ** expire()
+    **
+    ** Timer thread: the waiter timed out or was cancelled, unless it
+    ** completed in the meantime.
+    */
+    void expire(waiter *w, wait_list *list) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (w->state != PENDING)
+            return;
+        list->remove(w);
+        w->state = EXPIRED;
+        lock.unlock();
+        complete(w, false);
+    }
+
+    /*
+    ** complete()
+    **
+    ** Tear down a finished waiter's timer and stop callback and post
+    ** its coroutine to the executor. Called without the queue lock.
+    */
+    void complete(waiter *w, bool cancel_timer) {
+        w->stop.reset();
+        if (cancel_timer && w->timer)
+            detail::timer_service::instance().cancel(w->timer);
+        exec_(w->handle);
+    }
+
+    mutable std::mutex lock_;
+    executor exec_;
+    wait_list recvq_, sendq_;
+    detail::ring<T, Capacity> ring_;
+};
+
+} /* namespace smq */
+
+#endif /* __SMQ_CORO_HPP__ */
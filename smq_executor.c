@@ -0,0 +1,492 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Work-stealing task executor.
+**
+** Every worker owns a Chase-Lev deque: tasks spawned by a worker are
+** pushed and popped at the bottom of its own deque without any lock,
+** and idle workers steal from the top of a randomly chosen victim's
+** deque. Tasks submitted from outside the executor go through an SMQ
+** (the injection queue) which workers take from in small batches.
+**
+** Idle workers park on a condition variable. Publishing work checks an
+** idle counter and, only if someone is parked, wakes exactly one worker;
+** a busy executor never touches the park lock.
+**
+** The deque follows "Correct and Efficient Work-Stealing for Weak
+** Memory Models" (Le, Pop, Cohen, Zappa Nardelli; PPoPP 2013).
+*/
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "smq_executor.h"
+
+#define SMQ_EXEC_DEQUE_INIT     64
+#define SMQ_EXEC_INJECT_BATCH   16
+
+/*
+** One deque slot. Both halves are atomics so a thief may read a slot
+** while the owner writes elsewhere; a torn read is only ever seen by a
+** thief whose steal then fails and discards it.
+*/
+typedef struct st_smq_exec_slot {
+    _Atomic(uintptr_t) fn;
+    _Atomic(uintptr_t) arg;
+} SMQExecSlot;
+
+typedef struct st_smq_exec_array {
+    long size;
+    struct st_smq_exec_array *retired;
+    SMQExecSlot slots[];
+} SMQExecArray;
+
+typedef struct st_smq_exec_worker {
+    struct st_smq_executor *ex;
+    pthread_t tid;
+    unsigned int seed;
+
+    /* Chase-Lev deque */
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(SMQExecArray *) array;
+
+    /*
+    ** Arrays replaced by a grow; thieves may still be reading them so
+    ** they are only freed at destroy.
+    */
+    SMQExecArray *retired;
+} SMQExecWorker;
+
+struct st_smq_executor {
+    int nworkers;
+    SMQExecWorker *workers;
+
+    /*
+    ** Injection queue for tasks submitted from outside the workers
+    */
+    SMQ inject;
+
+    atomic_int stop;
+
+    /*
+    ** Parking. nidle counts workers that are (about to be) parked;
+    ** epoch changes whenever work is published to a parked executor.
+    */
+    atomic_int nidle;
+    atomic_ulong epoch;
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+};
+
+/*
+** The worker the current thread is, if any.
+*/
+static __thread SMQExecWorker *_smq_exec_self = NULL;
+
+/*
+** _smq_exec_array_new()
+*/
+static SMQExecArray *_smq_exec_array_new(long size) {
+    SMQExecArray *a;
+
+    if (!(a = calloc(1, sizeof(*a) + sizeof(SMQExecSlot) * size)))
+        return NULL;
+    a->size = size;
+    return a;
+}
+
+/*
+** _smq_exec_push()
+**
+** Owner only: push a task at the bottom of the deque, growing it if
+** full. Returns -1 only if growing failed.
+*/
+static int _smq_exec_push(SMQExecWorker *w, void (*fn)(void *), void *arg) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    SMQExecArray *a = atomic_load_explicit(&w->array, memory_order_relaxed);
+    SMQExecSlot *slot;
+
+    if (b - t > a->size - 1) {
+        SMQExecArray *grown;
+        long i;
+
+        if (!(grown = _smq_exec_array_new(a->size * 2)))
+            return -1;
+        for (i = t; i < b; i++) {
+            SMQExecSlot *from = &a->slots[i % a->size], *to = &grown->slots[i % grown->size];
+
+            atomic_store_explicit(&to->fn, atomic_load_explicit(&from->fn, memory_order_relaxed),
+                memory_order_relaxed);
+            atomic_store_explicit(&to->arg, atomic_load_explicit(&from->arg, memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        a->retired = w->retired;
+        w->retired = a;
+        atomic_store_explicit(&w->array, grown, memory_order_release);
+        a = grown;
+    }
+
+    slot = &a->slots[b % a->size];
+    atomic_store_explicit(&slot->fn, (uintptr_t)fn, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg, (uintptr_t)arg, memory_order_relaxed);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_release);
+    return 0;
+}
+
+/*
+** _smq_exec_take()
+**
+** Owner only: pop the most recently pushed task. Returns 1 if a task
+** was taken into ``task''.
+*/
+static int _smq_exec_take(SMQExecWorker *w, SMQTask *task) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    SMQExecArray *a = atomic_load_explicit(&w->array, memory_order_relaxed);
+    long t;
+    int found = 0;
+
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&w->top, memory_order_relaxed);
+
+    if (t <= b) {
+        SMQExecSlot *slot = &a->slots[b % a->size];
+
+        task->fn = (void (*)(void *))atomic_load_explicit(&slot->fn, memory_order_relaxed);
+        task->arg = (void *)atomic_load_explicit(&slot->arg, memory_order_relaxed);
+        found = 1;
+        if (t == b) {
+            /* last one; race thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+                found = 0;
+            atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    }
+    return found;
+}
+
+/*
+** _smq_exec_steal()
+**
+** Any thread: take the oldest task from ``w''. Returns 1 on success,
+** 0 if the deque is empty or the steal lost a race.
+*/
+static int _smq_exec_steal(SMQExecWorker *w, SMQTask *task) {
+    long t = atomic_load_explicit(&w->top, memory_order_acquire);
+    long b;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+
+    if (t < b) {
+        SMQExecArray *a = atomic_load_explicit(&w->array, memory_order_acquire);
+        SMQExecSlot *slot = &a->slots[t % a->size];
+
+        task->fn = (void (*)(void *))atomic_load_explicit(&slot->fn, memory_order_relaxed);
+        task->arg = (void *)atomic_load_explicit(&slot->arg, memory_order_relaxed);
+        return atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/*
+** _smq_exec_has_work()
+**
+** Whether any deque or the injection queue looks non-empty. Used by a
+** worker about to park.
+*/
+static int _smq_exec_has_work(struct st_smq_executor *ex) {
+    int i;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        SMQExecWorker *w = &ex->workers[i];
+
+        if (atomic_load(&w->bottom) - atomic_load(&w->top) > 0)
+            return 1;
+    }
+    return smq_get_count(ex->inject) > 0;
+}
+
+/*
+** _smq_exec_notify()
+**
+** Called after publishing work. Wakes one parked worker, if any.
+*/
+static void _smq_exec_notify(struct st_smq_executor *ex) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ex->nidle, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&ex->park_lock);
+        atomic_fetch_add(&ex->epoch, 1);
+        pthread_cond_signal(&ex->park_cond);
+        pthread_mutex_unlock(&ex->park_lock);
+    }
+}
+
+/*
+** _smq_exec_park()
+**
+** Park the calling worker until work is published or the executor
+** stops. Rechecks for work after announcing itself idle so a
+** concurrent publish is never missed.
+*/
+static void _smq_exec_park(struct st_smq_executor *ex) {
+    unsigned long epoch;
+
+    atomic_fetch_add(&ex->nidle, 1);
+    epoch = atomic_load(&ex->epoch);
+
+    if (!_smq_exec_has_work(ex) && !atomic_load(&ex->stop)) {
+        pthread_mutex_lock(&ex->park_lock);
+        while (atomic_load(&ex->epoch) == epoch && !atomic_load(&ex->stop))
+            pthread_cond_wait(&ex->park_cond, &ex->park_lock);
+        pthread_mutex_unlock(&ex->park_lock);
+    }
+
+    atomic_fetch_sub(&ex->nidle, 1);
+}
+
+/*
+** _smq_exec_find()
+**
+** Find the next task for worker ``w'': its own deque first, then a
+** batch from the injection queue, then steal from other workers
+** starting at a random victim.
+*/
+static int _smq_exec_find(SMQExecWorker *w, SMQTask *task) {
+    struct st_smq_executor *ex = w->ex;
+    SMQTask batch[SMQ_EXEC_INJECT_BATCH];
+    int i, n, start;
+
+    if (_smq_exec_take(w, task))
+        return 1;
+
+    if ((n = smq_recv_batch(ex->inject, batch, NULL, SMQ_EXEC_INJECT_BATCH, 0, NULL)) > 0) {
+        /* keep one, make the rest stealable */
+        *task = batch[0];
+        for (i = 1; i < n; i++) {
+            if (_smq_exec_push(w, batch[i].fn, batch[i].arg) < 0)
+                batch[i].fn(batch[i].arg);
+        }
+        if (n > 1)
+            _smq_exec_notify(ex);
+        return 1;
+    }
+
+    if (ex->nworkers > 1) {
+        w->seed = w->seed * 1103515245 + 12345;
+        start = (int)((w->seed >> 16) % (unsigned int)ex->nworkers);
+        for (i = 0; i < ex->nworkers; i++) {
+            SMQExecWorker *victim = &ex->workers[(start + i) % ex->nworkers];
+
+            if (victim != w && _smq_exec_steal(victim, task))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+** _smq_exec_free()
+**
+** Release everything owned by the executor. The workers have exited
+** (or were never started).
+*/
+static void _smq_exec_free(struct st_smq_executor *ex) {
+    int i;
+
+    for (i = 0; i < ex->nworkers; i++) {
+        SMQExecWorker *w = &ex->workers[i];
+        SMQExecArray *a, *next;
+
+        free (atomic_load(&w->array));
+        for (a = w->retired; a; a = next) {
+            next = a->retired;
+            free (a);
+        }
+    }
+
+    smq_destroy(ex->inject);
+    pthread_cond_destroy(&ex->park_cond);
+    pthread_mutex_destroy(&ex->park_lock);
+    free (ex->workers);
+    free (ex);
+}
+
+/*
+** _smq_exec_worker()
+**
+** Worker thread.
+*/
+static void *_smq_exec_worker(void *_w) {
+    SMQExecWorker *w = _w;
+    struct st_smq_executor *ex = w->ex;
+    SMQTask task;
+
+    _smq_exec_self = w;
+
+    for (;;) {
+        if (_smq_exec_find(w, &task)) {
+            task.fn(task.arg);
+            continue;
+        }
+
+        /* our own deque is empty and nothing could be found elsewhere */
+        if (atomic_load(&ex->stop) && !_smq_exec_has_work(ex))
+            break;
+
+        _smq_exec_park(ex);
+    }
+
+    _smq_exec_self = NULL;
+    return NULL;
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_executor_create()
+**
+** Create a work-stealing executor.
+**
+** @nworkers: Number of worker threads.
+**
+** Returns the executor, or NULL on error.
+*/
+SMQExecutor smq_executor_create(int nworkers) {
+    struct st_smq_executor *ex;
+    int i;
+
+    if (nworkers <= 0)
+        return NULL;
+
+    if (!(ex = calloc(1, sizeof(*ex))))
+        return NULL;
+    if (!(ex->workers = calloc(nworkers, sizeof(*ex->workers))) ||
+        !(ex->inject = smq_create(sizeof(SMQTask), 0, NULL))) {
+        free (ex->workers);
+        free (ex);
+        return NULL;
+    }
+
+    atomic_init(&ex->stop, 0);
+    atomic_init(&ex->nidle, 0);
+    atomic_init(&ex->epoch, 0);
+    pthread_mutex_init(&ex->park_lock, NULL);
+    pthread_cond_init(&ex->park_cond, NULL);
+
+    /* all deques exist before any worker may try to steal */
+    ex->nworkers = nworkers;
+    for (i = 0; i < nworkers; i++) {
+        SMQExecWorker *w = &ex->workers[i];
+
+        w->ex = ex;
+        w->seed = (unsigned int)i * 2654435761u + 1;
+        atomic_init(&w->top, 0);
+        atomic_init(&w->bottom, 0);
+        atomic_init(&w->array, _smq_exec_array_new(SMQ_EXEC_DEQUE_INIT));
+        if (!atomic_load(&w->array)) {
+            _smq_exec_free(ex);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&ex->workers[i].tid, NULL, _smq_exec_worker, &ex->workers[i])) {
+            int j;
+
+            /* stop and reap the workers which did start */
+            pthread_mutex_lock(&ex->park_lock);
+            atomic_store(&ex->stop, 1);
+            pthread_cond_broadcast(&ex->park_cond);
+            pthread_mutex_unlock(&ex->park_lock);
+            for (j = 0; j < i; j++)
+                pthread_join(ex->workers[j].tid, NULL);
+            _smq_exec_free(ex);
+            return NULL;
+        }
+    }
+
+    return ex;
+}
+
+/*
+** smq_executor_submit()
+**
+** Submit a task from any thread through the injection queue.
+**
+** Returns 0 on success, < 0 on error.
+*/
+int smq_executor_submit(SMQExecutor ex, void (*fn)(void *), void *arg) {
+    SMQTask task;
+
+    if (!fn)
+        return -1;
+    task.fn = fn;
+    task.arg = arg;
+    if (smq_send(ex->inject, &task, -1) < 0)
+        return -1;
+    _smq_exec_notify(ex);
+    return 0;
+}
+
+/*
+** smq_executor_spawn()
+**
+** Spawn a task. From inside a task running on this executor the task
+** goes onto the worker's own deque (no locking); anywhere else this is
+** the same as smq_executor_submit().
+**
+** Returns 0 on success, < 0 on error.
+*/
+int smq_executor_spawn(SMQExecutor ex, void (*fn)(void *), void *arg) {
+    SMQExecWorker *w = _smq_exec_self;
+
+    if (!fn)
+        return -1;
+    if (!w || w->ex != ex || _smq_exec_push(w, fn, arg) < 0)
+        return smq_executor_submit(ex, fn, arg);
+    _smq_exec_notify(ex);
+    return 0;
+}
+
+/*
+** smq_executor_destroy()
+**
+** Run every task already submitted or spawned (including tasks those
+** spawn) to completion, then stop the workers and free the executor.
+** Must not be called from one of the executor's own tasks.
+*/
+int smq_executor_destroy(SMQExecutor ex) {
+    int i;
+
+    pthread_mutex_lock(&ex->park_lock);
+    atomic_store(&ex->stop, 1);
+    pthread_cond_broadcast(&ex->park_cond);
+    pthread_mutex_unlock(&ex->park_lock);
+
+    for (i = 0; i < ex->nworkers; i++)
+        pthread_join(ex->workers[i].tid, NULL);
+
+    _smq_exec_free(ex);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_EXECUTOR_H__
+#define __SMQ_EXECUTOR_H__
+
+/*
+** A task: fn(arg) is called once on one of the executor's workers.
+*/
+typedef struct st_smq_task {
+    void (*fn)(void *);
+    void *arg;
+} SMQTask;
+
+/*
+** The executor holds C11 atomics and per-worker deques; its layout is
+** private to smq_executor.c.
+*/
+typedef struct st_smq_executor *SMQExecutor;
+
+
+extern SMQExecutor smq_executor_create(int);
+extern int smq_executor_submit(SMQExecutor, void (*)(void *), void *);
+extern int smq_executor_spawn(SMQExecutor, void (*)(void *), void *);
+extern int smq_executor_destroy(SMQExecutor);
+
+
+#endif /* __SMQ_EXECUTOR_H__ */
@@ -0,0 +1,259 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** The compressed block is a series of sequences, each a token byte
+** followed by literals and, except for the last sequence, a match:
+**
+**   token: high 4 bits literal count, low 4 bits match length - 4;
+**          15 in either means more length follows, in bytes of 255
+**          ended by a byte below 255
+**   [literal count extra] literals
+**   offset (2 bytes, little endian; distance back, 1..65535)
+**   [match length extra]
+**
+** The block ends after the literals of the last sequence, which has no
+** match. Matches may overlap the bytes they produce.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "smq_lz.h"
+
+#define SMQ_LZ_HASH_LOG     12
+#define SMQ_LZ_MIN_MATCH    4
+#define SMQ_LZ_MAX_OFFSET   65535
+
+/*
+** _smq_lz_read32()
+**
+** Unaligned 32 bit load.
+*/
+static inline uint32_t _smq_lz_read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+** _smq_lz_hash()
+**
+** Hash the 4 bytes at a position into the match table.
+*/
+static inline uint32_t _smq_lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - SMQ_LZ_HASH_LOG);
+}
+
+/*
+** _smq_lz_put_len()
+**
+** Write the extra bytes of a length that did not fit in its 4 bits.
+** Returns the new output position, or NULL if out of room.
+*/
+static uint8_t *_smq_lz_put_len(uint8_t *op, uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+** _smq_lz_get_len()
+**
+** Read the extra bytes of a length. Returns the new input position, or
+** NULL if the input ends first.
+*/
+static const uint8_t *_smq_lz_get_len(const uint8_t *ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+
+    do {
+        if (ip >= iend)
+            return NULL;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+/*
+** _smq_lz_sequence()
+**
+** Write one sequence: ``nlit'' literals from ``lit'', then (if mlen is
+** not 0) a match. Returns the new output position, or NULL if out of
+** room.
+*/
+static uint8_t *_smq_lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+    size_t offset, size_t mlen) {
+    uint8_t *token;
+
+    if (op >= oend)
+        return NULL;
+    token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && !(op = _smq_lz_put_len(op, oend, nlit - 15)))
+        return NULL;
+
+    if ((size_t)(oend - op) < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    mlen -= SMQ_LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && !(op = _smq_lz_put_len(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_lz_compress()
+**
+** Compress ``len'' bytes from ``src'' into ``dst''.
+**
+** @src: The input.
+** @len: Its length.
+** @dst: Where to write the compressed block.
+** @cap: The room at ``dst''. SMQ_LZ_BOUND(len) always suffices; pass
+**  less to give up early on input that does not compress well enough.
+**
+** Returns the compressed length, or 0 if it would exceed ``cap''.
+*/
+int smq_lz_compress(const void *src, int len, void *dst, int cap) {
+    uint32_t table[1 << SMQ_LZ_HASH_LOG];
+    const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len, *ref;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t seq, h;
+    size_t mlen, step;
+
+    if (len < 0 || cap <= 0)
+        return 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (end - ip >= SMQ_LZ_MIN_MATCH) {
+        seq = _smq_lz_read32(ip);
+        h = _smq_lz_hash(seq);
+        ref = in + table[h];
+        table[h] = (uint32_t)(ip - in);
+
+        if (ref >= ip || ip - ref > SMQ_LZ_MAX_OFFSET || _smq_lz_read32(ref) != seq) {
+            /*
+            ** Skip ahead faster the longer nothing has matched, but never
+            ** past the match limit: a pointer beyond ``end'' is undefined.
+            */
+            step = 1 + (size_t)((ip - anchor) >> 6);
+            if (step > (size_t)(end - ip))
+                break;
+            ip += step;
+            continue;
+        }
+
+        for (mlen = SMQ_LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+            ;
+
+        if (!(op = _smq_lz_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen)))
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if (!(op = _smq_lz_sequence(op, oend, anchor, end - anchor, 0, 0)))
+        return 0;
+    return (int)(op - (uint8_t *)dst);
+}
+
+/*
+** smq_lz_decompress()
+**
+** Decompress a block written by smq_lz_compress().
+**
+** @src: The compressed block.
+** @clen: Its length.
+** @dst: Where to write the output.
+** @len: The room at ``dst''; the original length.
+**
+** Returns the decompressed length, or -1 if the block is malformed or
+** would overrun ``dst''.
+*/
+int smq_lz_decompress(const void *src, int clen, void *dst, int len) {
+    const uint8_t *ip = src, *iend = ip + clen;
+    uint8_t *out = dst, *op = out, *oend = out + len;
+    const uint8_t *ref;
+    size_t nlit, mlen, offset;
+    uint8_t token;
+
+    if (clen <= 0 || len < 0)
+        return -1;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+
+        nlit = token >> 4;
+        if (nlit == 15 && !(ip = _smq_lz_get_len(ip, iend, &nlit)))
+            return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !(ip = _smq_lz_get_len(ip, iend, &mlen)))
+            return -1;
+        mlen += SMQ_LZ_MIN_MATCH;
+
+        if (!offset || offset > (size_t)(op - out) || (size_t)(oend - op) < mlen)
+            return -1;
+        ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            /* overlapping; a run repeating the last ``offset'' bytes */
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+
+    return (int)(op - out);
+}
@@ -0,0 +1,27 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#ifndef __SMQ_LZ_H__
+#define __SMQ_LZ_H__
+
+/*
+** A small, fast LZ77 block codec (in the style of LZ4) used by vSMQ to
+** compress large payloads. Not a stable or interchange format.
+*/
+
+/*
+** The largest compressed size of ``n'' bytes of input
+*/
+#define SMQ_LZ_BOUND(n)     ((n) + (n) / 255 + 16)
+
+extern int smq_lz_compress(const void *, int, void *, int);
+extern int smq_lz_decompress(const void *, int, void *, int);
+
+
+#endif /* __SMQ_LZ_H__ */
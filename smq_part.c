@@ -0,0 +1,326 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Key-partitioned queue. Keys hash to a fixed set of lanes, each a
+** FIFO of its own. A worker receiving from the queue is given a whole
+** lane and holds it until it calls smq_part_release(), so messages for
+** one key are never handled by two workers at once and stay in order,
+** while different lanes are handled in parallel. A released lane with
+** messages left goes to the back of the ready list, where any idle
+** worker may pick it up next; lanes are not tied to a worker.
+*/
+
+#include <errno.h>
+#include "smq_part.h"
+#include "smq_util.h"
+
+/*
+** _smq_part_lane()
+**
+** The lane for ``key''. Keys are mixed (Fibonacci hashing) first so
+** that sequential ids spread over the lanes.
+*/
+static SMQPartLane *_smq_part_lane(SMQPart p, unsigned long key) {
+    unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+
+    return &p->lanes[(h >> 32) % (unsigned long long)p->nlanes];
+}
+
+/*
+** _smq_part_wait()
+**
+** Wait on condr or condw; abstime of NULL waits forever.
+*/
+static int _smq_part_wait(SMQPart p, int sig, struct timespec *abstime) {
+    pthread_cond_t *cond = (sig == SMQ_SIG_READ) ? &p->_tdata.condr : &p->_tdata.condw;
+
+    if (abstime)
+        return pthread_cond_timedwait(cond, &p->_tdata.lock, abstime);
+    return pthread_cond_wait(cond, &p->_tdata.lock);
+}
+
+/*
+** _smq_part_make_ready()
+**
+** Put a lane with messages and no owner on the back of the ready list
+** and wake a receiver. Must be called with the lock held.
+*/
+static void _smq_part_make_ready(SMQPart p, SMQPartLane *lane) {
+    if (lane->owned || lane->ready || !lane->head)
+        return;
+
+    lane->ready = 1;
+    lane->rnext = NULL;
+    if (p->rtail)
+        p->rtail->rnext = lane;
+    else
+        p->rhead = lane;
+    p->rtail = lane;
+
+    pthread_cond_signal(&p->_tdata.condr);
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_part_create()
+**
+** Create a key-partitioned queue.
+**
+** @len: The length of each message.
+** @nlanes: The number of lanes keys are spread over. This bounds how
+**  many workers can make progress at once; a few times the number of
+**  workers keeps unrelated keys from often sharing a lane.
+** @max_count: The most messages queued across all lanes before sends
+**  wait (<= 0 for no limit).
+** @onfree: As for smq_create(); called for messages still queued when
+**  the queue is destroyed.
+**
+** Returns the SMQPart object or NULL on error.
+*/
+SMQPart smq_part_create(int len, int nlanes, int max_count, void (*onfree)(void *)) {
+    SMQPart p;
+
+    if (len <= 0 || nlanes <= 0)
+        return NULL;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        return NULL;
+    if (!(p->lanes = calloc(nlanes, sizeof(*p->lanes)))) {
+        free (p);
+        return NULL;
+    }
+
+    p->len = len;
+    p->nlanes = nlanes;
+    p->max_count = max_count;
+    p->onfree = onfree;
+    pthread_mutex_init(&p->_tdata.lock, NULL);
+    pthread_cond_init(&p->_tdata.condr, NULL);
+    pthread_cond_init(&p->_tdata.condw, NULL);
+    return p;
+}
+
+/*
+** smq_send_keyed_part()
+**
+** Send a message under ``key''. Messages with the same key are received
+** in the order they were sent and never by two workers at the same
+** time.
+**
+** @p: The partitioned queue.
+** @key: The key; e.g. an account id.
+** @data: The message, ``len'' bytes. NULL is an error.
+** @wait_ms: Same as smq_send(); only used once max_count is reached.
+**
+** Returns: 0 on success, < 0 on error.
+*/
+int smq_send_keyed_part(SMQPart p, unsigned long key, void *data, int wait_ms) {
+    struct timespec abstime, *_abstime = NULL;
+    SMQPartLane *lane;
+    SMQItem item;
+
+    if (!data)
+        return -1;
+
+    if (!(item = calloc(1, sizeof(*item) + p->len)))
+        return -1;
+    memmove(item->msg, data, p->len);
+    gettimeofday(&item->tv, NULL);
+
+    if (wait_ms > 0) {
+        _smq_timeout_time(&abstime, wait_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&p->_tdata.lock);
+
+    while (p->max_count > 0 && p->count >= p->max_count) {
+        if (wait_ms == 0 || _smq_part_wait(p, SMQ_SIG_WRITE, _abstime)) {
+            pthread_mutex_unlock(&p->_tdata.lock);
+            free (item);
+            return -1;
+        }
+    }
+
+    lane = _smq_part_lane(p, key);
+    if (lane->tail)
+        lane->tail->next = item;
+    else
+        lane->head = item;
+    lane->tail = item;
+    lane->count++;
+    p->count++;
+
+    _smq_part_make_ready(p, lane);
+
+    pthread_mutex_unlock(&p->_tdata.lock);
+    return 0;
+}
+
+/*
+** smq_part_recv()
+**
+** Take the lane which has been ready longest and receive up to ``max''
+** of its messages, in order. The lane then belongs to the caller until
+** it calls smq_part_release(); release it as soon as the messages have
+** been handled so the rest of the lane can move on.
+**
+** @p: The partitioned queue.
+** @data: Array of at least ``max'' messages (max * len bytes).
+** @tv: If not NULL, an array of ``max'' struct timeval receiving the
+**  send time of each message.
+** @max: The most messages to receive.
+** @timeout_ms: Same as for smq_recv().
+** @lane: Receives the lane number to pass to smq_part_release().
+**
+** Returns the number of messages received (0 if none, in which case no
+** lane is held).
+*/
+int smq_part_recv(SMQPart p, void *data, struct timeval *tv, int max, int timeout_ms,
+    int *lane) {
+    struct timespec abstime, *_abstime = NULL;
+    SMQPartLane *l;
+    SMQItem item, items;
+    char *d = data;
+    int n;
+
+    if (!data || !lane || max <= 0)
+        return 0;
+
+    if (timeout_ms > 0) {
+        _smq_timeout_time(&abstime, timeout_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&p->_tdata.lock);
+
+    while (!(l = p->rhead)) {
+        if (timeout_ms == 0 || _smq_part_wait(p, SMQ_SIG_READ, _abstime) == ETIMEDOUT) {
+            pthread_mutex_unlock(&p->_tdata.lock);
+            return 0;
+        }
+    }
+
+    if (!(p->rhead = l->rnext))
+        p->rtail = NULL;
+    l->ready = 0;
+    l->owned = 1;
+
+    /* detach up to max items; they are copied out after unlocking */
+    items = item = l->head;
+    for (n = 1; n < max && item->next; n++)
+        item = item->next;
+    l->head = item->next;
+    item->next = NULL;
+    if (!l->head)
+        l->tail = NULL;
+    l->count -= n;
+    p->count -= n;
+
+    if (p->max_count > 0) {
+        if (n > 1)
+            pthread_cond_broadcast(&p->_tdata.condw);
+        else
+            pthread_cond_signal(&p->_tdata.condw);
+    }
+
+    pthread_mutex_unlock(&p->_tdata.lock);
+
+    *lane = (int)(l - p->lanes);
+    for (n = 0; (item = items); n++) {
+        items = item->next;
+        if (tv)
+            memcpy(&tv[n], &item->tv, sizeof(*tv));
+        memmove(d, item->msg, p->len);
+        d += p->len;
+        free (item);
+    }
+
+    return n;
+}
+
+/*
+** smq_part_release()
+**
+** Give back a lane obtained from smq_part_recv(). If more messages
+** arrived for it meanwhile, it goes to the back of the ready list.
+**
+** @p: The partitioned queue.
+** @lane: The lane number returned by smq_part_recv().
+**
+** Returns 0, or -1 if the lane was not held.
+*/
+int smq_part_release(SMQPart p, int lane) {
+    SMQPartLane *l;
+
+    if (lane < 0 || lane >= p->nlanes)
+        return -1;
+    l = &p->lanes[lane];
+
+    pthread_mutex_lock(&p->_tdata.lock);
+    if (!l->owned) {
+        pthread_mutex_unlock(&p->_tdata.lock);
+        return -1;
+    }
+    l->owned = 0;
+    _smq_part_make_ready(p, l);
+    pthread_mutex_unlock(&p->_tdata.lock);
+    return 0;
+}
+
+/*
+** smq_part_get_count()
+**
+** Return the number of messages queued across all lanes.
+*/
+int smq_part_get_count(SMQPart p) {
+    int count;
+
+    pthread_mutex_lock(&p->_tdata.lock);
+    count = p->count;
+    pthread_mutex_unlock(&p->_tdata.lock);
+    return count;
+}
+
+/*
+** smq_part_destroy()
+**
+** Free the queue and any messages still in it (calling onfree(), if
+** set, for each). No thread may be using the queue.
+*/
+int smq_part_destroy(SMQPart p) {
+    SMQItem item;
+    int i;
+
+    for (i = 0; i < p->nlanes; i++) {
+        while ((item = p->lanes[i].head)) {
+            p->lanes[i].head = item->next;
+            if (p->onfree)
+                p->onfree(&item->msg[0]);
+            free (item);
+        }
+    }
+
+    pthread_cond_destroy(&p->_tdata.condr);
+    pthread_cond_destroy(&p->_tdata.condw);
+    pthread_mutex_destroy(&p->_tdata.lock);
+    free (p->lanes);
+    free (p);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_PART_H__
+#define __SMQ_PART_H__
+
+typedef struct st_smq_part_lane {
+    SMQItem head, tail;
+    int count;
+
+    /*
+    ** Set while a worker holds the lane (between smq_part_recv() and
+    ** smq_part_release()); nobody else receives from it meanwhile.
+    */
+    int owned;
+
+    /*
+    ** Set while the lane is on the ready list
+    */
+    int ready;
+    struct st_smq_part_lane *rnext;
+} SMQPartLane;
+
+typedef struct st_smq_part {
+    /*
+    ** The length of each message
+    */
+    int len;
+
+    /*
+    ** Messages queued across all lanes, and the limit (<= 0 for none)
+    */
+    int count;
+    int max_count;
+
+    void (*onfree)(void *);
+
+    /*
+    ** Keys hash to one of ``nlanes'' lanes. Lanes which have messages
+    ** and no owner wait on the ready list, in the order they became
+    ** ready.
+    */
+    SMQPartLane *lanes;
+    int nlanes;
+    SMQPartLane *rhead, *rtail;
+
+    struct {
+        pthread_mutex_t lock;
+
+        /*
+        ** Signalled when a lane becomes ready
+        */
+        pthread_cond_t condr;
+
+        /*
+        ** Signalled to writers when messages are received
+        */
+        pthread_cond_t condw;
+    } _tdata;
+} *SMQPart;
+
+
+extern SMQPart smq_part_create(int, int, int, void (*)(void *));
+extern int smq_send_keyed_part(SMQPart, unsigned long, void *, int);
+extern int smq_part_recv(SMQPart, void *, struct timeval *, int, int, int *);
+extern int smq_part_release(SMQPart, int);
+extern int smq_part_get_count(SMQPart);
+extern int smq_part_destroy(SMQPart);
+
+
+#endif /* __SMQ_PART_H__ */
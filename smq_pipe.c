@@ -0,0 +1,320 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Multi-stage pipeline on a single preallocated ring. Producers claim
+** a slot, fill it in place and publish it. Each stage then processes
+** the slot in place once the stage before it is done with it; the
+** slot is only reused once the final stage is done. Nothing is copied
+** or allocated between stages.
+**
+** Stages are gated by sequence barriers: stage s may process every
+** sequence below cursor[s - 1] (``published'' for stage 0) and each
+** stage advances its own cursor with smq_pipe_done().
+**
+** Every claimed slot must be published, in order, before any later one
+** can be; a producer which cannot fill its slot abandons it instead,
+** which publishes it marked as a no-op for the stages to skip.
+*/
+
+#include "smq_pipe.h"
+#include "smq_util.h"
+
+/*
+** _smq_pipe_barrier()
+**
+** The sequence stage ``stage'' may process up to (exclusive). Must be
+** called with the lock held.
+*/
+static unsigned long long _smq_pipe_barrier(SMQP p, int stage) {
+    return stage == 0 ? p->published : p->cursor[stage - 1];
+}
+
+/*
+** _smq_pipe_publish()
+**
+** Publish ``seq'' once every earlier claim has been, marking it as
+** abandoned or not.
+*/
+static int _smq_pipe_publish(SMQP p, unsigned long long seq, int abandoned) {
+    pthread_mutex_lock(&p->_tdata.lock);
+    if (seq >= p->claimed || seq < p->published) {
+        pthread_mutex_unlock(&p->_tdata.lock);
+        return -1;
+    }
+    while (p->published != seq)
+        pthread_cond_wait(&p->_tdata.condp, &p->_tdata.lock);
+    p->abandoned[seq % (unsigned long long)p->capacity] = (unsigned char)abandoned;
+    p->published = seq + 1;
+    pthread_cond_broadcast(&p->_tdata.condp);
+    pthread_cond_signal(&p->_tdata.conds[0]);
+    pthread_mutex_unlock(&p->_tdata.lock);
+    return 0;
+}
+
+/*
+** _smq_pipe_wait()
+**
+** Wait on ``cond''; abstime of NULL waits forever.
+*/
+static int _smq_pipe_wait(SMQP p, pthread_cond_t *cond, struct timespec *abstime) {
+    if (abstime)
+        return pthread_cond_timedwait(cond, &p->_tdata.lock, abstime);
+    return pthread_cond_wait(cond, &p->_tdata.lock);
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_pipe_create()
+**
+** Create a pipeline ring.
+**
+** @len: The length of each slot.
+** @capacity: The number of slots in the ring.
+** @nstages: The number of processing stages (at least 1).
+**
+** Returns the SMQP object or NULL on error.
+*/
+SMQP smq_pipe_create(int len, int capacity, int nstages) {
+    SMQP p;
+    int i;
+
+    if (len <= 0 || capacity <= 0 || nstages <= 0)
+        return NULL;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        return NULL;
+
+    p->slot_size = (int)((len + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+    p->slots = calloc(capacity, p->slot_size);
+    p->abandoned = calloc(capacity, sizeof(*p->abandoned));
+    p->cursor = calloc(nstages, sizeof(*p->cursor));
+    p->_tdata.conds = calloc(nstages, sizeof(*p->_tdata.conds));
+    if (!p->slots || !p->abandoned || !p->cursor || !p->_tdata.conds) {
+        free (p->slots);
+        free (p->abandoned);
+        free (p->cursor);
+        free (p->_tdata.conds);
+        free (p);
+        return NULL;
+    }
+
+    p->len = len;
+    p->capacity = capacity;
+    p->nstages = nstages;
+    pthread_mutex_init(&p->_tdata.lock, NULL);
+    pthread_cond_init(&p->_tdata.condw, NULL);
+    pthread_cond_init(&p->_tdata.condp, NULL);
+    for (i = 0; i < nstages; i++)
+        pthread_cond_init(&p->_tdata.conds[i], NULL);
+    return p;
+}
+
+/*
+** smq_pipe_claim()
+**
+** Claim the next slot for writing. The slot is filled in place by the
+** caller and then handed to the first stage with smq_pipe_publish().
+** Every claim must be published or abandoned (smq_pipe_abandon());
+** until it is, no later claim can be published.
+**
+** @p: The pipeline.
+** @seq: Receives the sequence number of the claimed slot.
+** @wait_ms: How long to wait for the final stage to free a slot; same
+**  meaning as for smq_send().
+**
+** Returns a pointer to the slot (``len'' bytes) or NULL on timeout.
+*/
+void *smq_pipe_claim(SMQP p, unsigned long long *seq, int wait_ms) {
+    struct timespec abstime, *_abstime = NULL;
+    unsigned long long s;
+
+    if (wait_ms > 0) {
+        _smq_timeout_time(&abstime, wait_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&p->_tdata.lock);
+    while (p->claimed - p->cursor[p->nstages - 1] >= (unsigned long long)p->capacity) {
+        if (wait_ms == 0 || _smq_pipe_wait(p, &p->_tdata.condw, _abstime)) {
+            pthread_mutex_unlock(&p->_tdata.lock);
+            return NULL;
+        }
+    }
+    s = p->claimed++;
+    pthread_mutex_unlock(&p->_tdata.lock);
+
+    *seq = s;
+    return smq_pipe_slot(p, s);
+}
+
+/*
+** smq_pipe_publish()
+**
+** Make a claimed slot visible to the first stage. Slots are published
+** in sequence order; if several producers are in use, this waits for
+** any earlier claims to be published first.
+**
+** Returns 0 on success, < 0 if ``seq'' is not an unpublished claim.
+*/
+int smq_pipe_publish(SMQP p, unsigned long long seq) {
+    return _smq_pipe_publish(p, seq, 0);
+}
+
+/*
+** smq_pipe_abandon()
+**
+** Give up a claimed slot which will not be filled (e.g. the producer
+** failed). It is published like any other, so later claims are not held
+** up, but marked so that every stage skips it: stages should check
+** smq_pipe_abandoned() and just pass such slots on with smq_pipe_done().
+**
+** Returns 0 on success, < 0 if ``seq'' is not an unpublished claim.
+*/
+int smq_pipe_abandon(SMQP p, unsigned long long seq) {
+    return _smq_pipe_publish(p, seq, 1);
+}
+
+/*
+** smq_pipe_abandoned()
+**
+** Whether the slot for ``seq'', as handed to a stage by smq_pipe_wait(),
+** was abandoned rather than published. Returns 1 if so, otherwise 0.
+*/
+int smq_pipe_abandoned(SMQP p, unsigned long long seq) {
+    return p->abandoned[seq % (unsigned long long)p->capacity];
+}
+
+/*
+** smq_pipe_send()
+**
+** Convenience for claim, copy ``len'' bytes from data, and publish.
+**
+** Returns 0 on success, < 0 on error or timeout.
+*/
+int smq_pipe_send(SMQP p, void *data, int wait_ms) {
+    unsigned long long seq;
+    void *slot;
+
+    if (!data)
+        return -1;
+    if (!(slot = smq_pipe_claim(p, &seq, wait_ms)))
+        return -1;
+    memcpy(slot, data, p->len);
+    return smq_pipe_publish(p, seq);
+}
+
+/*
+** smq_pipe_wait()
+**
+** Wait for slots to become available to a stage. Each stage must be
+** driven by a single thread.
+**
+** @p: The pipeline.
+** @stage: The stage, 0 through nstages - 1.
+** @seq: Receives the first available sequence number. Slots
+**  seq through seq + (return value - 1) may be processed in place
+**  through smq_pipe_slot().
+** @max: The most slots to hand back at once; <= 0 for no limit.
+** @timeout_ms: Same meaning as for smq_recv().
+**
+** Returns the number of slots available, 0 on timeout and < 0 if
+** stage is out of range.
+*/
+int smq_pipe_wait(SMQP p, int stage, unsigned long long *seq, int max, int timeout_ms) {
+    struct timespec abstime, *_abstime = NULL;
+    unsigned long long avail = 0;
+
+    if (stage < 0 || stage >= p->nstages)
+        return -1;
+
+    if (timeout_ms > 0) {
+        _smq_timeout_time(&abstime, timeout_ms);
+        _abstime = &abstime;
+    }
+
+    pthread_mutex_lock(&p->_tdata.lock);
+    for (; /* break inside */ ;) {
+        if ((avail = _smq_pipe_barrier(p, stage) - p->cursor[stage]))
+            break;
+        if (timeout_ms == 0 || _smq_pipe_wait(p, &p->_tdata.conds[stage], _abstime))
+            break;
+    }
+    *seq = p->cursor[stage];
+    pthread_mutex_unlock(&p->_tdata.lock);
+
+    if (max > 0 && avail > (unsigned long long)max)
+        avail = max;
+    return (int)avail;
+}
+
+/*
+** smq_pipe_slot()
+**
+** Address of the slot for sequence ``seq''.
+*/
+void *smq_pipe_slot(SMQP p, unsigned long long seq) {
+    return p->slots + (size_t)(seq % (unsigned long long)p->capacity) * p->slot_size;
+}
+
+/*
+** smq_pipe_done()
+**
+** Mark the next ``n'' slots as processed by ``stage'', releasing them
+** to the next stage (or, for the final stage, back to producers).
+**
+** Returns 0 on success, < 0 on error.
+*/
+int smq_pipe_done(SMQP p, int stage, int n) {
+    if (stage < 0 || stage >= p->nstages || n <= 0)
+        return -1;
+
+    pthread_mutex_lock(&p->_tdata.lock);
+    if (p->cursor[stage] + n > _smq_pipe_barrier(p, stage)) {
+        pthread_mutex_unlock(&p->_tdata.lock);
+        return -1;
+    }
+    p->cursor[stage] += n;
+    if (stage == p->nstages - 1)
+        pthread_cond_broadcast(&p->_tdata.condw);
+    else
+        pthread_cond_signal(&p->_tdata.conds[stage + 1]);
+    pthread_mutex_unlock(&p->_tdata.lock);
+    return 0;
+}
+
+/*
+** smq_pipe_destroy()
+**
+** Free the pipeline. No thread may be using it.
+*/
+int smq_pipe_destroy(SMQP p) {
+    int i;
+
+    for (i = 0; i < p->nstages; i++)
+        pthread_cond_destroy(&p->_tdata.conds[i]);
+    pthread_cond_destroy(&p->_tdata.condw);
+    pthread_cond_destroy(&p->_tdata.condp);
+    pthread_mutex_destroy(&p->_tdata.lock);
+    free (p->_tdata.conds);
+    free (p->cursor);
+    free (p->abandoned);
+    free (p->slots);
+    free (p);
+    return 0;
+}
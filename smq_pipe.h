@@ -0,0 +1,92 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_PIPE_H__
+#define __SMQ_PIPE_H__
+
+typedef struct st_smq_pipe {
+    /*
+    ** The length of each slot (message)
+    */
+    int len;
+
+    /*
+    ** Number of slots in the ring
+    */
+    int capacity;
+
+    /*
+    ** Number of stages; each stage is consumed by one thread
+    */
+    int nstages;
+
+    char *slots;
+    int slot_size;
+
+    /*
+    ** One per slot; set when the slot's current claim was given up with
+    ** smq_pipe_abandon() (see smq_pipe_abandoned())
+    */
+    unsigned char *abandoned;
+
+    /*
+    ** Next sequence handed out to a producer by smq_pipe_claim()
+    */
+    unsigned long long claimed;
+
+    /*
+    ** Every sequence below this has been published and may be
+    ** processed by stage 0.
+    */
+    unsigned long long published;
+
+    /*
+    ** Per stage; every sequence below cursor[s] has been processed
+    ** by stage s. Stage s may process up to cursor[s - 1] (or
+    ** ``published'' for stage 0) and producers may reuse slots below
+    ** cursor[nstages - 1].
+    */
+    unsigned long long *cursor;
+
+    struct {
+        pthread_mutex_t lock;
+
+        /*
+        ** Producers waiting for the final stage to free a slot
+        */
+        pthread_cond_t condw;
+
+        /*
+        ** Producers waiting for earlier claims to be published
+        */
+        pthread_cond_t condp;
+
+        /*
+        ** One per stage; signalled when the stage's barrier advances
+        */
+        pthread_cond_t *conds;
+    } _tdata;
+} *SMQP;
+
+
+extern SMQP smq_pipe_create(int, int, int);
+extern void *smq_pipe_claim(SMQP, unsigned long long *, int);
+extern int smq_pipe_publish(SMQP, unsigned long long);
+extern int smq_pipe_abandon(SMQP, unsigned long long);
+extern int smq_pipe_abandoned(SMQP, unsigned long long);
+extern int smq_pipe_send(SMQP, void *, int);
+extern int smq_pipe_wait(SMQP, int, unsigned long long *, int, int);
+extern void *smq_pipe_slot(SMQP, unsigned long long);
+extern int smq_pipe_done(SMQP, int, int);
+extern int smq_pipe_destroy(SMQP);
+
+
+#endif /* __SMQ_PIPE_H__ */
@@ -0,0 +1,456 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Record the messages sent to a queue into a file, and replay such a
+** file into a queue later; e.g. to benchmark consumers against real
+** production traffic.
+**
+** The recorder hooks the queue (smq_set_record_hook()) and copies each
+** message, as it is queued, into an in-memory buffer. Full buffers are
+** handed to a writer thread, so senders never wait on the disk. If the
+** writer falls behind and every buffer is full, messages are dropped
+** from the recording (and counted), never from the queue.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include "smq_lz.h"
+#include "smq_record.h"
+#include "smq_util.h"
+#include "vsmq.h"
+
+/*
+** How often (ms) a partly filled buffer is written out anyway, so that
+** a quiet queue still reaches the disk
+*/
+#define SMQ_RECORD_FLUSH_MS     1000
+
+/*
+** Longest (ms) smq_replay() sleeps or waits on a full queue before
+** checking its interrupt
+*/
+#define SMQ_REPLAY_SLICE_MS     100
+
+/*
+** _smq_record_rotate()
+**
+** Queue the current buffer for the writer and start filling a spare
+** one. Must be called with the lock held. Returns 0, or -1 if there is
+** no spare buffer.
+*/
+static int _smq_record_rotate(SMQRecorder r) {
+    SMQRecordBuf b;
+
+    if (!r->cur->used)
+        return 0;
+    if (!(b = r->spare))
+        return -1;
+    r->spare = b->next;
+
+    r->cur->next = NULL;
+    if (r->full_tail)
+        r->full_tail->next = r->cur;
+    else
+        r->full = r->cur;
+    r->full_tail = r->cur;
+
+    b->used = 0;
+    b->count = 0;
+    r->cur = b;
+
+    pthread_cond_signal(&r->cond);
+    return 0;
+}
+
+/*
+** _smq_record_hook()
+**
+** The queue's record hook: append one record to the current buffer.
+** Called with the queue locked.
+*/
+static void _smq_record_hook(SMQ q, const void *msg, const struct timeval *tv, void *arg) {
+    SMQRecorder r = arg;
+    vSMQ_WRAP wrap;
+    int vsmq = r->flags & SMQ_RECORD_VSMQ;
+    uint32_t size = (uint32_t)q->len, rsize, raw;
+    uint64_t us;
+    size_t need;
+    char *p;
+
+    /* messages are not necessarily aligned in the queue */
+    if (vsmq) {
+        memcpy(&wrap, msg, sizeof(wrap));
+        size = wrap.csz ? (uint32_t)(sizeof(raw) + wrap.csz) : (uint32_t)wrap.sz;
+    }
+    need = SMQ_RECORD_HDRSIZE + size;
+    us = (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (need > SMQ_RECORD_BUFSIZE || r->stats.error ||
+        (r->cur->used + need > SMQ_RECORD_BUFSIZE && _smq_record_rotate(r) < 0))
+        goto drop;
+
+    p = r->cur->data + r->cur->used;
+    rsize = vsmq && wrap.csz ? size | SMQ_RECORD_LZ : size;
+    memcpy(p, &us, sizeof(us));
+    memcpy(p + sizeof(us), &rsize, sizeof(rsize));
+
+    /* compressed vSMQ payloads are kept compressed; smq_replay() undoes it */
+    if (!vsmq)
+        memcpy(p + SMQ_RECORD_HDRSIZE, msg, size);
+    else if (!wrap.csz)
+        memcpy(p + SMQ_RECORD_HDRSIZE, wrap.ptr, size);
+    else {
+        raw = (uint32_t)wrap.sz;
+        memcpy(p + SMQ_RECORD_HDRSIZE, &raw, sizeof(raw));
+        memcpy(p + SMQ_RECORD_HDRSIZE + sizeof(raw), wrap.ptr, (size_t)wrap.csz);
+    }
+
+    r->cur->used += need;
+    r->cur->count++;
+    pthread_mutex_unlock(&r->lock);
+    return;
+
+drop:
+    r->stats.dropped++;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+** _smq_record_writer()
+**
+** Writer thread: write out full buffers as they come and return them
+** to the spare list.
+*/
+static void *_smq_record_writer(void *_r) {
+    SMQRecorder r = _r;
+    struct timespec abstime;
+    SMQRecordBuf b;
+    int error;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->full) {
+            if (r->stop) {
+                /* the hook is gone; whatever is in ``cur'' is the last of it */
+                if (!r->cur->used)
+                    goto out;
+                _smq_record_rotate(r);
+                break;
+            }
+            _smq_timeout_time(&abstime, SMQ_RECORD_FLUSH_MS);
+            if (pthread_cond_timedwait(&r->cond, &r->lock, &abstime) == ETIMEDOUT)
+                _smq_record_rotate(r);
+        }
+
+        if (!(r->full = (b = r->full)->next))
+            r->full_tail = NULL;
+        error = r->stats.error;
+        pthread_mutex_unlock(&r->lock);
+
+        if (!error) {
+            if (fwrite(b->data, 1, b->used, r->fp) != b->used)
+                error = errno ? errno : EIO;
+            else if (!r->full && fflush(r->fp))
+                error = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        if (error)
+            r->stats.error = error;
+        else {
+            r->stats.messages += b->count;
+            r->stats.bytes += b->used;
+        }
+        b->next = r->spare;
+        r->spare = b;
+    }
+
+out:
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/*
+** _smq_record_free()
+**
+** Close the file and free the recorder and its buffers.
+*/
+static int _smq_record_free(SMQRecorder r) {
+    SMQRecordBuf b;
+    int error = 0;
+
+    if (r->fp && fclose(r->fp))
+        error = errno ? errno : EIO;
+    free (r->cur);
+    while ((b = r->spare)) {
+        r->spare = b->next;
+        free (b);
+    }
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free (r);
+    return error;
+}
+
+/*
+** _smq_replay_wait()
+**
+** Sleep until ``due'' seconds after ``start'' (CLOCK_MONOTONIC) or
+** until interrupted.
+*/
+static void _smq_replay_wait(struct timespec *start, double due, volatile int *interrupt) {
+    struct timespec now, ts;
+    double left;
+
+    for (;;) {
+        if (interrupt && *interrupt)
+            return;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = due - ((double)(now.tv_sec - start->tv_sec) +
+            (double)(now.tv_nsec - start->tv_nsec) / 1000000000.0);
+        if (left <= 0)
+            return;
+        if (left > SMQ_REPLAY_SLICE_MS / 1000.0)
+            left = SMQ_REPLAY_SLICE_MS / 1000.0;
+        dbl2timespec(&ts, left);
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_record_start()
+**
+** Start recording every message sent to a queue, with the time it was
+** sent, into a file. The file is written by a thread of its own from
+** SMQ_RECORD_BUFFERS buffers of SMQ_RECORD_BUFSIZE; senders only copy
+** the message into the current buffer. Replaces any other record hook
+** on the queue.
+**
+** @q: The SMQ or vSMQ to record.
+** @path: The file to create (or truncate).
+** @flags: SMQ_RECORD_VSMQ if q is a vSMQ, otherwise 0.
+**
+** Returns the recorder or NULL on error.
+*/
+SMQRecorder smq_record_start(SMQ q, const char *path, int flags) {
+    SMQRecordHeader hdr;
+    SMQRecordBuf b;
+    SMQRecorder r;
+    int i;
+
+    if (!q || !path)
+        return NULL;
+    if ((flags & SMQ_RECORD_VSMQ) && q->len != (int)sizeof(vSMQ_WRAP))
+        return NULL;
+
+    if (!(r = calloc(1, sizeof(*r))))
+        return NULL;
+    r->q = q;
+    r->flags = flags;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    for (i = 0; i < SMQ_RECORD_BUFFERS; i++) {
+        if (!(b = malloc(sizeof(*b) + SMQ_RECORD_BUFSIZE))) {
+            _smq_record_free(r);
+            return NULL;
+        }
+        b->used = 0;
+        b->count = 0;
+        b->next = r->spare;
+        r->spare = b;
+    }
+    r->cur = r->spare;
+    r->spare = r->cur->next;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SMQ_RECORD_MAGIC, sizeof(hdr.magic));
+    hdr.flags = (uint32_t)(flags & SMQ_RECORD_VSMQ);
+    hdr.len = (flags & SMQ_RECORD_VSMQ) ? 0 : (uint32_t)q->len;
+
+    if (!(r->fp = fopen(path, "wb")) || fwrite(&hdr, sizeof(hdr), 1, r->fp) != 1) {
+        _smq_record_free(r);
+        return NULL;
+    }
+    r->stats.bytes = sizeof(hdr);
+
+    if (pthread_create(&r->tid, NULL, _smq_record_writer, r)) {
+        _smq_record_free(r);
+        return NULL;
+    }
+
+    smq_set_record_hook(q, _smq_record_hook, r);
+    return r;
+}
+
+/*
+** smq_record_stop()
+**
+** Stop recording, write out what is buffered, close the file and free
+** the recorder. The queue itself is not touched.
+**
+** @r: The recorder.
+** @stats: If not NULL, receives the final statistics.
+**
+** Returns 0, or -1 if writing the file failed (see stats.error).
+*/
+int smq_record_stop(SMQRecorder r, SMQRecordStats *stats) {
+    int error;
+
+    /* once this returns, no sender is inside the hook */
+    smq_set_record_hook(r->q, NULL, NULL);
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->tid, NULL);
+
+    if (stats)
+        *stats = r->stats;
+    error = r->stats.error;
+
+    if ((r->fp && fclose(r->fp)) && !error) {
+        error = errno ? errno : EIO;
+        if (stats)
+            stats->error = error;
+    }
+    r->fp = NULL;
+
+    _smq_record_free(r);
+    return error ? -1 : 0;
+}
+
+/*
+** smq_replay()
+**
+** Send the messages of a recording into a queue, in order, from the
+** calling thread. A recording from a vSMQ can only be replayed into a
+** vSMQ, and one from an SMQ only into an SMQ with the same ``len''.
+** Messages get the time they are replayed as their send time.
+**
+** @q: The SMQ or vSMQ to send into.
+** @path: The recording.
+** @speed: 1.0 keeps the original gaps between messages, 2.0 halves
+**  them and so on; <= 0 sends as fast as the queue takes them.
+** @interrupt: If not NULL, replay stops once this becomes non-zero.
+**
+** Returns the number of messages sent, or -1 if the file could not be
+** read or does not suit the queue. A truncated last record (e.g. from a
+** recorder that never stopped) ends the replay quietly, as does one
+** which cannot be decompressed.
+*/
+long long smq_replay(SMQ q, const char *path, double speed, volatile int *interrupt) {
+    char rhdr[SMQ_RECORD_HDRSIZE], *buf = NULL, *dbuf = NULL, *msg, *nbuf;
+    struct timespec start;
+    SMQRecordHeader hdr;
+    uint64_t us, first = 0;
+    uint32_t size, cap, raw, dcap = 0;
+    long long n = 0;
+    int vsmq, lz, wait_ms, r;
+    FILE *fp;
+
+    if (!q || !path || !(fp = fopen(path, "rb")))
+        return -1;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, SMQ_RECORD_MAGIC, sizeof(hdr.magic))) {
+        fclose(fp);
+        return -1;
+    }
+    vsmq = hdr.flags & SMQ_RECORD_VSMQ;
+    if (vsmq ? q->len != (int)sizeof(vSMQ_WRAP) : hdr.len != (uint32_t)q->len) {
+        fclose(fp);
+        return -1;
+    }
+
+    cap = vsmq ? 4096 : (uint32_t)q->len;
+    if (!(buf = malloc(cap))) {
+        fclose(fp);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!(interrupt && *interrupt) && fread(rhdr, sizeof(rhdr), 1, fp) == 1) {
+        memcpy(&us, rhdr, sizeof(us));
+        memcpy(&size, rhdr + sizeof(us), sizeof(size));
+        lz = !!(size & SMQ_RECORD_LZ);
+        size &= ~SMQ_RECORD_LZ;
+        if (size > SMQ_RECORD_BUFSIZE || (!vsmq && (lz || size != (uint32_t)q->len)) ||
+            (lz && size <= sizeof(raw)))
+            break;
+        if (size > cap) {
+            if (!(nbuf = realloc(buf, size)))
+                break;
+            buf = nbuf;
+            cap = size;
+        }
+        if (size && fread(buf, size, 1, fp) != 1)
+            break;
+
+        /* recorded as queued, compressed; restore it here rather than in the hook */
+        msg = buf;
+        if (lz) {
+            memcpy(&raw, buf, sizeof(raw));
+            if (!raw || raw >= INT_MAX)
+                break;
+            if (raw > dcap) {
+                if (!(nbuf = realloc(dbuf, raw)))
+                    break;
+                dbuf = nbuf;
+                dcap = raw;
+            }
+            if (smq_lz_decompress(buf + sizeof(raw), (int)(size - sizeof(raw)), dbuf, (int)raw) != (int)raw)
+                break;
+            msg = dbuf;
+            size = raw;
+        }
+
+        if (speed > 0) {
+            /* the first message sets the clock; out of order times do not wait */
+            if (!first)
+                first = us;
+            if (us > first)
+                _smq_replay_wait(&start, (double)(us - first) / 1000000.0 / speed, interrupt);
+        }
+
+        /* vsmq_send() does not take empty messages */
+        if (vsmq && !size)
+            continue;
+
+        /* wait in slices so that a full queue does not hide the interrupt */
+        wait_ms = interrupt ? SMQ_REPLAY_SLICE_MS : -1;
+        do {
+            r = vsmq ? vsmq_send(q, msg, (int)size, wait_ms) : smq_send(q, msg, wait_ms);
+        } while (r < 0 && interrupt && !*interrupt);
+        if (r < 0)
+            break;
+        n++;
+    }
+
+    free (dbuf);
+    free (buf);
+    fclose(fp);
+    return n;
+}
@@ -0,0 +1,127 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include <stdint.h>
+#include "smq.h"
+
+#ifndef __SMQ_RECORD_H__
+#define __SMQ_RECORD_H__
+
+/*
+** Flags for smq_record_start()
+*/
+#define SMQ_RECORD_VSMQ     0x01    /* the queue is a vSMQ */
+
+/*
+** Size and number of the buffers records are gathered in before the
+** writer thread takes them; when all are full, messages are dropped
+** (and counted) rather than holding up the queue.
+*/
+#define SMQ_RECORD_BUFSIZE  (1024 * 1024)
+#define SMQ_RECORD_BUFFERS  8
+
+/*
+** A recording starts with this header, followed by one record per
+** message: a 64 bit send time in microseconds since the epoch, a 32
+** bit payload size and the payload. Everything is in host byte order.
+*/
+#define SMQ_RECORD_MAGIC    "SMQREC01"
+
+/*
+** Set in a record's size when the payload is a vSMQ message still
+** compressed as it was queued (see vsmq_set_compression()): the 32 bit
+** decompressed size, then the smq_lz block. smq_replay() decompresses
+** it, so the queue's senders never pay for it.
+*/
+#define SMQ_RECORD_LZ       0x80000000u
+
+typedef struct st_smq_record_header {
+    char magic[8];
+
+    /*
+    ** SMQ_RECORD_VSMQ, if recorded from a vSMQ
+    */
+    uint32_t flags;
+
+    /*
+    ** The message length of the queue recorded (an SMQ); for a vSMQ,
+    ** each record carries its own size
+    */
+    uint32_t len;
+} SMQRecordHeader;
+
+#define SMQ_RECORD_HDRSIZE  (sizeof(uint64_t) + sizeof(uint32_t))
+
+typedef struct st_smq_record_stats {
+    /*
+    ** Messages and bytes (including headers) written to the file
+    */
+    unsigned long long messages;
+    unsigned long long bytes;
+
+    /*
+    ** Messages not recorded because every buffer was full, or the
+    ** message would not fit in one
+    */
+    unsigned long long dropped;
+
+    /*
+    ** errno of the write error which ended the recording, or 0
+    */
+    int error;
+} SMQRecordStats;
+
+typedef struct st_smq_record_buf {
+    struct st_smq_record_buf *next;
+    size_t used;
+
+    /*
+    ** Messages in the buffer
+    */
+    unsigned long long count;
+    char data[];
+} *SMQRecordBuf;
+
+typedef struct st_smq_recorder {
+    SMQ q;
+    FILE *fp;
+    int flags;
+
+    /*
+    ** ``cur'' is being filled by senders, ``full'' (oldest first) waits
+    ** for the writer and ``spare'' is ready for reuse
+    */
+    SMQRecordBuf cur;
+    SMQRecordBuf full, full_tail;
+    SMQRecordBuf spare;
+
+    /*
+    ** Set by smq_record_stop()
+    */
+    int stop;
+
+    SMQRecordStats stats;
+
+    pthread_mutex_t lock;
+
+    /*
+    ** Signalled to the writer when a buffer fills or on stop
+    */
+    pthread_cond_t cond;
+
+    pthread_t tid;
+} *SMQRecorder;
+
+
+extern SMQRecorder smq_record_start(SMQ, const char *, int);
+extern int smq_record_stop(SMQRecorder, SMQRecordStats *);
+extern long long smq_replay(SMQ, const char *, double, volatile int *);
+
+
+#endif /* __SMQ_RECORD_H__ */
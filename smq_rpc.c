@@ -0,0 +1,479 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Request/reply between threads. Clients send requests, each tagged
+** with an SMQRpcId, into one shared request queue; servers receive them
+** in batches and answer by id. Replies land in a pool of slots made up
+** front (one per call in flight), each with its own condition variable,
+** so a call costs no allocation, queue or lock of its own: the pool is
+** the only per-call state, and it is reused.
+**
+** A call holds its slot from smq_rpc_send() until its reply is collected
+** by smq_rpc_wait() or it is cancelled; a call cancelled before a server
+** received its request holds it until then, so that the request queue,
+** sized to the pool, can never be full. Each reuse bumps the slot's
+** generation, which is part of the id, so a late reply to a call which
+** gave up is dropped rather than delivered to the slot's next call.
+*/
+
+#include <errno.h>
+#include "smq_rpc.h"
+#include "smq_util.h"
+
+/*
+** _smq_rpc_slot()
+**
+** The slot ``id'' refers to, or NULL if it is not a current id (one
+** which is free, cancelled or reused). Must be called with the lock held.
+*/
+static SMQRpcSlot *_smq_rpc_slot(SMQRpc r, SMQRpcId id) {
+    uint32_t idx = (uint32_t)id;
+    SMQRpcSlot *s;
+
+    if (idx >= (uint32_t)r->nslots)
+        return NULL;
+    s = &r->slots[idx];
+    if (s->state == SMQ_RPC_FREE || s->state == SMQ_RPC_CANCELLED ||
+        s->gen != (uint32_t)(id >> 32))
+        return NULL;
+    return s;
+}
+
+/*
+** _smq_rpc_release()
+**
+** Return a slot to the pool. Must be called with the lock held.
+*/
+static void _smq_rpc_release(SMQRpc r, SMQRpcSlot *s) {
+    s->state = SMQ_RPC_FREE;
+    s->queued = 0;
+    s->next = r->free;
+    r->free = s;
+    pthread_cond_signal(&r->cond);
+}
+
+/*
+** _smq_rpc_scratch_get() / _smq_rpc_scratch_put()
+**
+** Take an idle scratch buffer (making one the first time, or when
+** several servers receive at once) and give it back.
+*/
+static SMQRpcScratch _smq_rpc_scratch_get(SMQRpc r) {
+    SMQRpcScratch sc;
+
+    pthread_mutex_lock(&r->lock);
+    if ((sc = r->scratch))
+        r->scratch = sc->next;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!sc)
+        sc = malloc(sizeof(*sc) + (sizeof(SMQRpcId) + (size_t)r->req_len) * (size_t)r->nslots);
+    return sc;
+}
+
+static void _smq_rpc_scratch_put(SMQRpc r, SMQRpcScratch sc) {
+    pthread_mutex_lock(&r->lock);
+    sc->next = r->scratch;
+    r->scratch = sc;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+** _smq_rpc_cond_wait()
+**
+** Wait on ``cond''; abstime of NULL waits forever.
+*/
+static int _smq_rpc_cond_wait(SMQRpc r, pthread_cond_t *cond, struct timespec *abstime) {
+    if (abstime)
+        return pthread_cond_timedwait(cond, &r->lock, abstime);
+    return pthread_cond_wait(cond, &r->lock);
+}
+
+/*
+** _smq_rpc_send()
+**
+** smq_rpc_send(), with the deadline (if timeout_ms > 0) worked out by
+** the caller. Only waiting for a slot takes time: queueing the request
+** then never waits.
+*/
+static SMQRpcId _smq_rpc_send(SMQRpc r, void *req, int timeout_ms, struct timespec *abstime) {
+    SMQRpcSlot *s;
+    SMQRpcId id;
+
+    if (!req)
+        return 0;
+
+    pthread_mutex_lock(&r->lock);
+    while (!(s = r->free)) {
+        if (timeout_ms == 0 || _smq_rpc_cond_wait(r, &r->cond, abstime) == ETIMEDOUT) {
+            pthread_mutex_unlock(&r->lock);
+            return 0;
+        }
+    }
+    r->free = s->next;
+    if (!++s->gen)
+        s->gen = 1;
+    s->state = SMQ_RPC_PENDING;
+    s->queued = 1;
+    id = ((SMQRpcId)s->gen << 32) | (SMQRpcId)(s - r->slots);
+    pthread_mutex_unlock(&r->lock);
+
+    /* nobody replies into the slot until the request has been received */
+    memcpy(s->buf, &id, sizeof(id));
+    memcpy(s->buf + sizeof(id), req, r->req_len);
+
+    /* there is room: every queued request holds a slot, and we hold ours */
+    if (smq_send(r->requests, s->buf, 0) < 0) {
+        pthread_mutex_lock(&r->lock);
+        _smq_rpc_release(r, s);
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    return id;
+}
+
+/*
+** _smq_rpc_wait()
+**
+** smq_rpc_wait(), with the deadline (if timeout_ms > 0) worked out by
+** the caller.
+*/
+static int _smq_rpc_wait(SMQRpc r, SMQRpcId id, void *rep, int timeout_ms,
+    struct timespec *abstime) {
+    SMQRpcSlot *s;
+
+    pthread_mutex_lock(&r->lock);
+    if (!(s = _smq_rpc_slot(r, id))) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    while (s->state == SMQ_RPC_PENDING) {
+        if (timeout_ms == 0 || _smq_rpc_cond_wait(r, &s->cond, abstime) == ETIMEDOUT) {
+            pthread_mutex_unlock(&r->lock);
+            return 0;
+        }
+    }
+
+    if (rep)
+        memcpy(rep, s->buf, r->rep_len);
+    _smq_rpc_release(r, s);
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+}
+
+
+/*
+************************************************************************
+**
+** Standard API functions start here
+**
+************************************************************************
+*/
+
+
+/*
+** smq_rpc_create()
+**
+** Create a request/reply channel.
+**
+** @req_len: The length of each request.
+** @rep_len: The length of each reply (may be 0).
+** @nslots: The most calls in flight at once; further calls wait for a
+**  slot. Also the capacity of the request queue.
+**
+** Returns the SMQRpc object or NULL on error.
+*/
+SMQRpc smq_rpc_create(int req_len, int rep_len, int nslots) {
+    size_t bufsize;
+    SMQRpc r;
+    int i;
+
+    if (req_len <= 0 || rep_len < 0 || nslots <= 0)
+        return NULL;
+
+    if (!(r = calloc(1, sizeof(*r))))
+        return NULL;
+
+    /* keep every slot's buffer aligned for the id */
+    bufsize = sizeof(SMQRpcId) + (size_t)(req_len > rep_len ? req_len : rep_len);
+    bufsize = (bufsize + sizeof(SMQRpcId) - 1) & ~(sizeof(SMQRpcId) - 1);
+
+    r->slots = calloc(nslots, sizeof(*r->slots));
+    r->bufs = malloc(bufsize * (size_t)nslots);
+    r->requests = smq_create_prealloc((int)sizeof(SMQRpcId) + req_len, nslots, NULL, 0, -1);
+    if (!r->slots || !r->bufs || !r->requests) {
+        if (r->requests)
+            smq_destroy(r->requests);
+        free (r->bufs);
+        free (r->slots);
+        free (r);
+        return NULL;
+    }
+
+    r->req_len = req_len;
+    r->rep_len = rep_len;
+    r->nslots = nslots;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    for (i = nslots - 1; i >= 0; i--) {
+        pthread_cond_init(&r->slots[i].cond, NULL);
+        r->slots[i].buf = r->bufs + bufsize * (size_t)i;
+        r->slots[i].next = r->free;
+        r->free = &r->slots[i];
+    }
+    return r;
+}
+
+/*
+** smq_rpc_send()
+**
+** Start a call: take a reply slot and queue the request. Collect the
+** reply with smq_rpc_wait() (or give up with smq_rpc_cancel()); until
+** then the slot stays taken.
+**
+** @r: The channel.
+** @req: The request, ``req_len'' bytes.
+** @wait_ms: Same as smq_send(); how long to wait for a free slot.
+**
+** Returns the call's id, or 0 on error or timeout.
+*/
+SMQRpcId smq_rpc_send(SMQRpc r, void *req, int wait_ms) {
+    struct timespec abstime;
+
+    if (wait_ms > 0)
+        _smq_timeout_time(&abstime, wait_ms);
+    return _smq_rpc_send(r, req, wait_ms, wait_ms > 0 ? &abstime : NULL);
+}
+
+/*
+** smq_rpc_wait()
+**
+** Wait for the reply to a call. Once it is collected the id is spent.
+** Only one thread should wait on a given id.
+**
+** @r: The channel.
+** @id: From smq_rpc_send().
+** @rep: Receives the reply, ``rep_len'' bytes; may be NULL.
+** @timeout_ms: Same as for smq_recv(). After a timeout the call is
+**  still in flight: wait again or cancel it.
+**
+** Returns 1 if the reply was received, 0 on timeout, -1 if ``id'' is
+** not a call in flight.
+*/
+int smq_rpc_wait(SMQRpc r, SMQRpcId id, void *rep, int timeout_ms) {
+    struct timespec abstime;
+
+    if (timeout_ms > 0)
+        _smq_timeout_time(&abstime, timeout_ms);
+    return _smq_rpc_wait(r, id, rep, timeout_ms, timeout_ms > 0 ? &abstime : NULL);
+}
+
+/*
+** smq_rpc_cancel()
+**
+** Give up on a call and free its slot. Its request is skipped if not
+** yet received, and any reply is dropped. If the request is still
+** queued, the slot is only freed once a server has taken it.
+**
+** Returns 0, or -1 if ``id'' is not a call in flight.
+*/
+int smq_rpc_cancel(SMQRpc r, SMQRpcId id) {
+    SMQRpcSlot *s;
+
+    pthread_mutex_lock(&r->lock);
+    if (!(s = _smq_rpc_slot(r, id))) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    if (s->queued)
+        s->state = SMQ_RPC_CANCELLED;
+    else
+        _smq_rpc_release(r, s);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+/*
+** smq_rpc_call()
+**
+** Send a request and wait for its reply; smq_rpc_send() followed by
+** smq_rpc_wait(), cancelling the call if the reply does not come in
+** time.
+**
+** @r: The channel.
+** @req: The request, ``req_len'' bytes.
+** @rep: Receives the reply, ``rep_len'' bytes; may be NULL.
+** @timeout_ms: Same as for smq_recv(); covers the whole call.
+**
+** Returns 1 if the reply was received, 0 on timeout, -1 on error.
+*/
+int smq_rpc_call(SMQRpc r, void *req, void *rep, int timeout_ms) {
+    struct timespec abstime, *_abstime = NULL;
+    SMQRpcId id;
+    int retval;
+
+    if (timeout_ms > 0) {
+        _smq_timeout_time(&abstime, timeout_ms);
+        _abstime = &abstime;
+    }
+
+    if (!(id = _smq_rpc_send(r, req, timeout_ms, _abstime)))
+        return timeout_ms < 0 ? -1 : 0;
+    if ((retval = _smq_rpc_wait(r, id, rep, timeout_ms, _abstime)) == 0)
+        smq_rpc_cancel(r, id);
+    return retval;
+}
+
+/*
+** smq_rpc_recv()
+**
+** Receive up to ``max'' requests for a server to answer, under a single
+** lock of the request queue (see smq_recv_batch()). Requests whose call
+** has been cancelled are skipped.
+**
+** @r: The channel.
+** @ids: Array of ``max'' ids; receives the id to answer each request
+**  with.
+** @reqs: Array of at least ``max'' requests (max * req_len bytes).
+** @max: The most requests to receive.
+** @timeout_ms: Same as for smq_recv().
+** @interrupt: As for smq_recv_batch(); see smq_rpc_wakeup().
+**
+** Returns the number of requests received (0 if none), or -1 on error.
+*/
+int smq_rpc_recv(SMQRpc r, SMQRpcId *ids, void *reqs, int max, int timeout_ms,
+    volatile int *interrupt) {
+    size_t frame = sizeof(SMQRpcId) + (size_t)r->req_len;
+    SMQRpcScratch sc;
+    char *buf, *d = reqs;
+    SMQRpcSlot *s;
+    SMQRpcId id;
+    int i, n, got;
+
+    if (!ids || !reqs || max <= 0)
+        return 0;
+    /* no more than nslots requests can be queued */
+    if (max > r->nslots)
+        max = r->nslots;
+    if (!(sc = _smq_rpc_scratch_get(r)))
+        return -1;
+    buf = sc->buf;
+
+    n = smq_recv_batch(r->requests, buf, NULL, max, timeout_ms, interrupt);
+
+    pthread_mutex_lock(&r->lock);
+    for (i = got = 0; i < n; i++) {
+        memcpy(&id, buf + frame * (size_t)i, sizeof(id));
+
+        /* a queued request's slot is never reused, so this is its own */
+        s = &r->slots[(uint32_t)id];
+        s->queued = 0;
+        if (s->state == SMQ_RPC_CANCELLED) {
+            _smq_rpc_release(r, s);
+            continue;
+        }
+        if (!_smq_rpc_slot(r, id))
+            continue;
+        ids[got] = id;
+        memcpy(d + (size_t)got * r->req_len, buf + frame * (size_t)i + sizeof(id), r->req_len);
+        got++;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    _smq_rpc_scratch_put(r, sc);
+    return got;
+}
+
+/*
+** smq_rpc_reply()
+**
+** Answer one request and wake its caller.
+**
+** @r: The channel.
+** @id: The request's id, from smq_rpc_recv().
+** @rep: The reply, ``rep_len'' bytes.
+**
+** Returns 0, or -1 if the call is no longer waiting (it was cancelled,
+** timed out or already answered); the reply is then dropped.
+*/
+int smq_rpc_reply(SMQRpc r, SMQRpcId id, void *rep) {
+    return smq_rpc_reply_batch(r, &id, rep, 1) == 1 ? 0 : -1;
+}
+
+/*
+** smq_rpc_reply_batch()
+**
+** Answer ``n'' requests at once, taking the lock only once.
+**
+** @r: The channel.
+** @ids: The requests' ids, from smq_rpc_recv().
+** @reps: Array of ``n'' replies (n * rep_len bytes), in the same order.
+** @n: The number of replies.
+**
+** Returns the number of replies delivered; replies to calls no longer
+** waiting are dropped.
+*/
+int smq_rpc_reply_batch(SMQRpc r, SMQRpcId *ids, void *reps, int n) {
+    const char *rep = reps;
+    SMQRpcSlot *s;
+    int i, delivered = 0;
+
+    if (!ids || (!reps && r->rep_len))
+        return 0;
+
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < n; i++) {
+        if (!(s = _smq_rpc_slot(r, ids[i])) || s->state != SMQ_RPC_PENDING)
+            continue;
+        if (r->rep_len)
+            memcpy(s->buf, rep + (size_t)i * r->rep_len, r->rep_len);
+        s->state = SMQ_RPC_DONE;
+        pthread_cond_signal(&s->cond);
+        delivered++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return delivered;
+}
+
+/*
+** smq_rpc_wakeup()
+**
+** Wake servers blocked in smq_rpc_recv() so they see their interrupt
+** flag.
+*/
+void smq_rpc_wakeup(SMQRpc r) {
+    smq_wakeup(r->requests);
+}
+
+/*
+** smq_rpc_destroy()
+**
+** Free the channel. No thread may be using it.
+*/
+int smq_rpc_destroy(SMQRpc r) {
+    SMQRpcScratch sc;
+    int i;
+
+    while ((sc = r->scratch)) {
+        r->scratch = sc->next;
+        free (sc);
+    }
+
+    smq_destroy(r->requests);
+    for (i = 0; i < r->nslots; i++)
+        pthread_cond_destroy(&r->slots[i].cond);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free (r->bufs);
+    free (r->slots);
+    free (r);
+    return 0;
+}
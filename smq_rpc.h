@@ -0,0 +1,107 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+#include <stdint.h>
+#include "smq.h"
+
+#ifndef __SMQ_RPC_H__
+#define __SMQ_RPC_H__
+
+/*
+** Identifies one call; 0 is never a valid id. The low 32 bits are the
+** reply slot, the high 32 bits that slot's generation, so a reply to a
+** call which has since been cancelled or timed out is recognised as
+** stale and dropped.
+*/
+typedef uint64_t SMQRpcId;
+
+/*
+** Reply slot states
+*/
+#define SMQ_RPC_FREE        0   /* on the free list */
+#define SMQ_RPC_PENDING     1   /* call sent, no reply yet */
+#define SMQ_RPC_DONE        2   /* reply waiting to be collected */
+#define SMQ_RPC_CANCELLED   3   /* cancelled, request still queued */
+
+typedef struct st_smq_rpc_slot {
+    uint32_t gen;
+    int state;
+
+    /*
+    ** Set while the request is in the request queue; a cancelled call
+    ** keeps its slot until then, so every queued request holds a slot
+    */
+    int queued;
+
+    /*
+    ** Signalled when the reply arrives
+    */
+    pthread_cond_t cond;
+
+    /*
+    ** Holds the request frame (id, then request) while it is sent, and
+    ** then the reply
+    */
+    char *buf;
+
+    struct st_smq_rpc_slot *next;
+} SMQRpcSlot;
+
+/*
+** Frame buffer for smq_rpc_recv(), holding up to ``nslots'' requests
+** with their ids; reused across calls rather than allocated per call
+*/
+typedef struct st_smq_rpc_scratch {
+    struct st_smq_rpc_scratch *next;
+    char buf[];
+} *SMQRpcScratch;
+
+typedef struct st_smq_rpc {
+    /*
+    ** Requests, each prefixed with its SMQRpcId. Its storage is
+    ** preallocated for ``nslots'' requests: each holds a slot, so there
+    ** is always room for one more.
+    */
+    SMQ requests;
+
+    int req_len;
+    int rep_len;
+
+    SMQRpcSlot *slots;
+    int nslots;
+    SMQRpcSlot *free;
+    char *bufs;
+
+    pthread_mutex_t lock;
+
+    /*
+    ** Signalled when a slot is freed
+    */
+    pthread_cond_t cond;
+
+    /*
+    ** Idle scratch buffers, one per server receiving at the same time
+    */
+    SMQRpcScratch scratch;
+} *SMQRpc;
+
+
+extern SMQRpc smq_rpc_create(int, int, int);
+extern SMQRpcId smq_rpc_send(SMQRpc, void *, int);
+extern int smq_rpc_wait(SMQRpc, SMQRpcId, void *, int);
+extern int smq_rpc_cancel(SMQRpc, SMQRpcId);
+extern int smq_rpc_call(SMQRpc, void *, void *, int);
+extern int smq_rpc_recv(SMQRpc, SMQRpcId *, void *, int, int, volatile int *);
+extern int smq_rpc_reply(SMQRpc, SMQRpcId, void *);
+extern int smq_rpc_reply_batch(SMQRpc, SMQRpcId *, void *, int);
+extern void smq_rpc_wakeup(SMQRpc);
+extern int smq_rpc_destroy(SMQRpc);
+
+
+#endif /* __SMQ_RPC_H__ */
@@ -0,0 +1,110 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Static tracepoints used internally by the queue code. Nothing here
+** is compiled in unless one (or both) of the following is defined when
+** building the library:
+**
+**  SMQ_USDT        Emit USDT probes (provider ``smq'') through <sys/sdt.h>
+**                  which may be attached to with perf, bpftrace, etc.
+**  SMQ_TRACE_HOOK  Call the in-process hook installed with
+**                  smq_set_trace_hook().
+**
+** Every probe carries the queue pointer, the depth (count) of the queue,
+** an auxiliary value (see smq.h for the meaning per event) and a
+** CLOCK_MONOTONIC timestamp in nanoseconds.
+*/
+
+#include <time.h>
+#include "smq.h"
+
+#ifndef __SMQ_TRACE_H__
+#define __SMQ_TRACE_H__
+
+#if defined(SMQ_USDT) || defined(SMQ_TRACE_HOOK)
+#define SMQ_TRACE_ENABLED 1
+#endif
+
+#ifdef SMQ_USDT
+/*
+** Probes get a semaphore each, which a tracer increments while it is
+** attached, so that an unwatched probe costs one load and no timestamp.
+*/
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define _SMQ_USDT_SEMAPHORE(name) \
+    __extension__ extern unsigned short smq_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+_SMQ_USDT_SEMAPHORE(enqueue);
+_SMQ_USDT_SEMAPHORE(dequeue);
+_SMQ_USDT_SEMAPHORE(block_start);
+_SMQ_USDT_SEMAPHORE(block_stop);
+_SMQ_USDT_SEMAPHORE(timeout);
+_SMQ_USDT_SEMAPHORE(signal);
+_SMQ_USDT_SEMAPHORE(wipe);
+#define _SMQ_USDT_ENABLED(name) \
+    __builtin_expect(__atomic_load_n(&smq_##name##_semaphore, __ATOMIC_RELAXED) != 0, 0)
+#define _SMQ_USDT(name, q, depth, aux, ts) \
+    DTRACE_PROBE4(smq, name, q, depth, aux, ts)
+#else
+#define _SMQ_USDT_ENABLED(name) 0
+#define _SMQ_USDT(name, q, depth, aux, ts) do { } while (0)
+#endif
+
+#ifdef SMQ_TRACE_HOOK
+/*
+** Set by smq_set_trace_hook() while other threads fire tracepoints;
+** the argument is stored before the hook and read after it.
+*/
+extern SMQTraceHook _smq_trace_hook;
+extern void *_smq_trace_arg;
+#define _SMQ_HOOK_GET() __atomic_load_n(&_smq_trace_hook, __ATOMIC_ACQUIRE)
+#define _SMQ_HOOK_ARG() __atomic_load_n(&_smq_trace_arg, __ATOMIC_RELAXED)
+#else
+#define _SMQ_HOOK_GET() ((SMQTraceHook)NULL)
+#define _SMQ_HOOK_ARG() NULL
+#endif
+
+#ifdef SMQ_TRACE_ENABLED
+/*
+** _smq_trace_now()
+**
+** Timestamp attached to each probe.
+*/
+static inline unsigned long long _smq_trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+** SMQ_TRACE()
+**
+** Fire a tracepoint. ``name'' is the USDT probe name and ``ev'' the
+** SMQ_TRACE_* event passed to the hook. The timestamp is only taken
+** when a tracer is attached to the probe or a hook is installed.
+*/
+#define SMQ_TRACE(name, ev, q, aux) \
+    do { \
+        SMQTraceHook _hook = _SMQ_HOOK_GET(); \
+        unsigned long long _ts; \
+        if (_SMQ_USDT_ENABLED(name) || _hook) { \
+            _ts = _smq_trace_now(); \
+            _SMQ_USDT(name, q, (q)->count, aux, _ts); \
+            if (_hook) \
+                _hook(ev, q, (q)->count, aux, _ts, _SMQ_HOOK_ARG()); \
+        } \
+    } while (0)
+#else
+#define SMQ_TRACE(name, ev, q, aux) do { } while (0)
+#endif
+
+#endif /* __SMQ_TRACE_H__ */
@@ -0,0 +1,174 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Type-specialized queues generated at compile time.
+**
+**  SMQ_DEFINE_TYPED(name, type, capacity)
+**
+** generates a queue type ``name_t'' holding up to ``capacity'' elements
+** of ``type'' and the following static inline functions:
+**
+**  name_t *name_create(void);
+**  int name_send(name_t *q, const type *data, int wait_ms);
+**  int name_recv(name_t *q, type *data, int timeout_ms);
+**  int name_get_count(name_t *q);
+**  int name_destroy(name_t *q);
+**
+** These behave like smq_create()/smq_send()/smq_recv()/smq_get_count()/
+** smq_destroy() -- same locking, same condition variables and the same
+** millisecond timeout semantics -- but as the element size and the
+** capacity are compile-time constants, small elements are copied with
+** plain moves instead of a memmove of a runtime length, and the calls
+** are inlined. No per-message allocation or timestamp is taken.
+**
+** A generated queue is a standalone ring of its own, not an SMQ: it
+** cannot be passed to the smq_*() functions (smq_wakeup(), consumers,
+** bridges, ...). Layering it on an SMQ would bring back the runtime
+** length copy and per-message item it exists to avoid.
+**
+** Example:
+**
+**  SMQ_DEFINE_TYPED(evq, struct event, 1024)
+**
+**  evq_t *q = evq_create();
+**  evq_send(q, &ev, -1);
+**  evq_recv(q, &ev, 100);
+*/
+
+#include <time.h>
+#include "smq.h"
+
+#ifndef __SMQ_TYPED_H__
+#define __SMQ_TYPED_H__
+
+/*
+** _smq_typed_deadline()
+**
+** The pthread_cond_timedwait() deadline ``ms'' from now. A private copy
+** of smq_util.h's helper, which is not part of the public API.
+*/
+static inline void _smq_typed_deadline(struct timespec *abstime, int ms) {
+    clock_gettime(CLOCK_REALTIME, abstime);
+    abstime->tv_sec += ms / 1000;
+    abstime->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (abstime->tv_nsec >= 1000000000L) {
+        abstime->tv_sec++;
+        abstime->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+** _SMQ_TYPED_WAIT()
+**
+** Slow path shared by every generated queue: wait on ``cond'' until
+** the predicate holds. The caller holds ``lock'' and has checked the
+** predicate once already. ``waiters'' is the count the other side
+** checks before signalling.
+*/
+#define _SMQ_TYPED_WAIT(q, cond, waiters, pred, ms) \
+    do { \
+        struct timespec _abstime, *_pabstime = NULL; \
+        int _rc = 0; \
+        if ((ms) > 0) { \
+            _smq_typed_deadline(&_abstime, (ms)); \
+            _pabstime = &_abstime; \
+        } \
+        (q)->waiters++; \
+        while (!(pred) && !_rc) { \
+            if (_pabstime) \
+                _rc = pthread_cond_timedwait(&(q)->_tdata.cond, &(q)->_tdata.lock, _pabstime); \
+            else \
+                _rc = pthread_cond_wait(&(q)->_tdata.cond, &(q)->_tdata.lock); \
+        } \
+        (q)->waiters--; \
+    } while (0)
+
+#define SMQ_DEFINE_TYPED(name, type, capacity) \
+    typedef char name##_capacity_must_be_positive[(capacity) > 0 ? 1 : -1]; \
+    \
+    typedef struct st_##name { \
+        int head; \
+        int count; \
+        int rwait, wwait; \
+        struct { \
+            pthread_mutex_t lock; \
+            pthread_cond_t condr; \
+            pthread_cond_t condw; \
+        } _tdata; \
+        type slots[capacity]; \
+    } name##_t; \
+    \
+    static inline name##_t *name##_create(void) { \
+        name##_t *q; \
+        if (!(q = calloc(1, sizeof(*q)))) \
+            return NULL; \
+        pthread_mutex_init(&q->_tdata.lock, NULL); \
+        pthread_cond_init(&q->_tdata.condr, NULL); \
+        pthread_cond_init(&q->_tdata.condw, NULL); \
+        return q; \
+    } \
+    \
+    static inline int name##_send(name##_t *q, const type *data, int wait_ms) { \
+        if (!data) \
+            return -1; \
+        pthread_mutex_lock(&q->_tdata.lock); \
+        if (q->count >= (capacity)) { \
+            if (wait_ms != 0) \
+                _SMQ_TYPED_WAIT(q, condw, wwait, q->count < (capacity), wait_ms); \
+            if (q->count >= (capacity)) { \
+                pthread_mutex_unlock(&q->_tdata.lock); \
+                return -1; \
+            } \
+        } \
+        q->slots[(unsigned)(q->head + q->count) % (unsigned)(capacity)] = *data; \
+        q->count++; \
+        if (q->rwait) \
+            pthread_cond_signal(&q->_tdata.condr); \
+        pthread_mutex_unlock(&q->_tdata.lock); \
+        return 0; \
+    } \
+    \
+    static inline int name##_recv(name##_t *q, type *data, int timeout_ms) { \
+        pthread_mutex_lock(&q->_tdata.lock); \
+        if (!q->count) { \
+            if (timeout_ms != 0) \
+                _SMQ_TYPED_WAIT(q, condr, rwait, q->count > 0, timeout_ms); \
+            if (!q->count) { \
+                pthread_mutex_unlock(&q->_tdata.lock); \
+                return 0; \
+            } \
+        } \
+        if (data) \
+            *data = q->slots[q->head]; \
+        q->head = (int)((unsigned)(q->head + 1) % (unsigned)(capacity)); \
+        q->count--; \
+        if (q->wwait) \
+            pthread_cond_signal(&q->_tdata.condw); \
+        pthread_mutex_unlock(&q->_tdata.lock); \
+        return 1; \
+    } \
+    \
+    static inline int name##_get_count(name##_t *q) { \
+        int count; \
+        pthread_mutex_lock(&q->_tdata.lock); \
+        count = q->count; \
+        pthread_mutex_unlock(&q->_tdata.lock); \
+        return count; \
+    } \
+    \
+    static inline int name##_destroy(name##_t *q) { \
+        pthread_cond_destroy(&q->_tdata.condr); \
+        pthread_cond_destroy(&q->_tdata.condw); \
+        pthread_mutex_destroy(&q->_tdata.lock); \
+        free (q); \
+        return 0; \
+    }
+
+#endif /* __SMQ_TYPED_H__ */
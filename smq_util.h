@@ -0,0 +1,104 @@
+/*
+** This is free and unencumbered software released into the public domain.
+**
+** Refer to LICENSE for additional information.
+*/
+/*
+** Original Author: Keith Fralick
+*/
+
+/*
+** Time conversion helpers shared by the SMQ sources (and the inline
+** functions generated by smq_typed.h). Not part of the public API.
+*/
+
+#include "smq.h"
+
+#ifndef __SMQ_UTIL_H__
+#define __SMQ_UTIL_H__
+
+/*
+** tv2dbl()
+**
+** Convert a struct timeval into a floating point(double) representing
+** the time.
+*/
+static inline double tv2dbl(struct timeval *tv) {
+    return (double)tv->tv_sec + ((double)tv->tv_usec / (double)1000000.0);
+}
+
+/*
+** gettime_dbl()
+**
+** Return the current time as a floating point (double) value instead
+** of as a struct timeval *
+*/
+static inline double gettime_dbl(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv2dbl(&tv);
+}
+
+#ifdef INCLUDE_DB2TV
+/*
+** dbl2tv()
+**
+** Convert a floating point (double) value into a struct timeval where
+** tv_sec and tv_usec are populated for seconds and microseconds.
+*/
+static inline int dbl2tv(struct timeval *tv, double t) {
+    tv->tv_sec = (time_t)t;
+    tv->tv_usec = (suseconds_t) ((t - (double)tv->tv_sec) * 1000000);
+    return 0;
+}
+#endif
+
+/*
+** dbl2timespec()
+**
+** Convert a floating point (double) value into a struct timespec, used
+** for abstime in pthread_cond_timedwait(). Important to note here we use
+** nanoseconds instead of microseconds.
+*/
+static inline int dbl2timespec(struct timespec *spec, double t) {
+    spec->tv_sec = (time_t) t;
+    spec->tv_nsec = ((t - (double)spec->tv_sec) * 1000000000);
+    return 0;
+}
+
+/*
+** _smq_timeout_time()
+**
+** Given a timeout in milliseconds, get the current time and add to it
+** the milliseconds in the future for the exiration time; then, convert
+** this to struct timespec. This is to be used directly in pthread_cond_timedwait().
+*/
+static inline int _smq_timeout_time(struct timespec *abstime, int timeout_ms) {
+    double current_time, expire_time;
+
+    /* fetch the current time as a double */
+    current_time = gettime_dbl();
+
+    /* calculate the expiration time, which is in the future */
+    expire_time = current_time + ((double)timeout_ms / (double)1000.0);
+
+    return dbl2timespec(abstime, expire_time);
+}
+
+/*
+** _smq_cpu_relax()
+**
+** Hint to the CPU that we are spinning (``pause'' on x86). Keeps a
+** polling loop from starving a sibling hyperthread and from flooding
+** the memory system with speculative loads.
+*/
+static inline void _smq_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#endif /* __SMQ_UTIL_H__ */
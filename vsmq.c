@@ -26,7 +26,21 @@
 ** Original Author: Keith Fralick
 */
 
+#include <errno.h>
+#include <limits.h>
 #include "vsmq.h"
+#include "smq_lz.h"
+
+/*
+** vSMQ control block, hung off the queue's onfree_ctx
+*/
+typedef struct st_vsmq_ctl {
+    /*
+    ** Payloads of at least this many bytes are compressed (0 for
+    ** never); see vsmq_set_compression(). Accessed atomically.
+    */
+    int min_compress;
+} vSMQ_CTL;
 
 /*
 ** _vsmq_free()
@@ -41,6 +55,48 @@ static void _vsmq_free(void *p) {
         free (wrap->ptr);
 }
 
+/*
+** _vsmq_compress()
+**
+** Replace a message's payload with its compressed form, if that saves
+** enough to be worth it.
+*/
+static void _vsmq_compress(vSMQ_WRAP *wrap) {
+    int cap = wrap->sz - wrap->sz / VSMQ_MIN_SAVING, csz;
+    void *c, *shrunk;
+
+    if (!(c = malloc(cap)))
+        return;
+    if (!(csz = smq_lz_compress(wrap->ptr, wrap->sz, c, cap))) {
+        free (c);
+        return;
+    }
+
+    /* hand back the unused part of the buffer */
+    if ((shrunk = realloc(c, csz)))
+        c = shrunk;
+
+    free (wrap->ptr);
+    wrap->ptr = c;
+    wrap->csz = csz;
+}
+
+/*
+** _vsmq_attach()
+**
+** Give a freshly created queue its control block; on failure the queue
+** is destroyed. Returns the queue or NULL.
+*/
+static vSMQ _vsmq_attach(vSMQ q) {
+    if (!q)
+        return NULL;
+    if (!(q->onfree_ctx = calloc(1, sizeof(vSMQ_CTL)))) {
+        smq_destroy(q);
+        return NULL;
+    }
+    return q;
+}
+
 /*
 ** vsmq_create()
 **
@@ -50,7 +106,19 @@ static void _vsmq_free(void *p) {
 **  occurs.
 */
 vSMQ vsmq_create(int queue_size) {
-    return smq_create(sizeof(vSMQ_WRAP), queue_size, _vsmq_free);
+    return _vsmq_attach(smq_create(sizeof(vSMQ_WRAP), queue_size, _vsmq_free));
+}
+
+/*
+** vsmq_create_combining()
+**
+** Wrapper for smq_create_combining(); a vSMQ using flat combining.
+**
+** @queue_size: The maximum size of the queue before blocking/waiting
+**  occurs.
+*/
+vSMQ vsmq_create_combining(int queue_size) {
+    return _vsmq_attach(smq_create_combining(sizeof(vSMQ_WRAP), queue_size, _vsmq_free));
 }
 
 /*
@@ -67,33 +135,132 @@ vSMQ vsmq_create(int queue_size) {
 ** Returns 0 on success or -1 on error.
 */
 int vsmq_send(vSMQ q, void *data, int sz, int timeout_ms) {
-    vSMQ_WRAP wrap;
-    void *p;
-    int retval;
+    struct iovec iov;
 
     /* data must be ``something'' and size must also be something, too */
     if (!data || sz <= 0)
         return -1;
 
-    /* allocate memory for the message */
-    if (!(p = calloc(1, sz + 1)))
+    iov.iov_base = data;
+    iov.iov_len = sz;
+    return vsmq_sendv(q, &iov, 1, timeout_ms);
+}
+
+/*
+** vsmq_sendv()
+**
+** Like vsmq_send(), but the message is gathered from several buffers
+** (e.g. a header and a body) straight into its copy in the queue, with
+** no need to join them first.
+**
+** @q: The vSMQ object
+** @iov: The buffers making up the message, in order.
+** @iovcnt: The number of buffers.
+** @timeout_ms: The timeout period to write for write.
+**
+** Returns 0 on success or -1 on error (including an empty message).
+*/
+int vsmq_sendv(vSMQ q, const struct iovec *iov, int iovcnt, int timeout_ms) {
+    vSMQ_WRAP wrap;
+    size_t sz = 0;
+    char *p, *d;
+    int i, min;
+
+    if (!iov || iovcnt <= 0)
+        return -1;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len && !iov[i].iov_base)
+            return -1;
+        sz += iov[i].iov_len;
+    }
+    if (sz == 0 || sz >= INT_MAX)
         return -1;
 
-    /* copy over the data */
-    memcpy(p, data, sz);
+    /* one extra byte so that strings arrive terminated */
+    if (!(p = malloc(sz + 1)))
+        return -1;
+    for (i = 0, d = p; i < iovcnt; i++) {
+        memcpy(d, iov[i].iov_base, iov[i].iov_len);
+        d += iov[i].iov_len;
+    }
+    *d = '\0';
 
-    /* record the size and point to the copied data ptr */
-    wrap.sz = sz;
+    wrap.sz = (int)sz;
+    wrap.csz = 0;
     wrap.ptr = p;
 
+    min = __atomic_load_n(&((vSMQ_CTL *)q->onfree_ctx)->min_compress, __ATOMIC_RELAXED);
+    if (min > 0 && wrap.sz >= min)
+        _vsmq_compress(&wrap);
+
     /* send to the queue */
-    if ((retval = smq_send(q, &wrap, timeout_ms)) < 0) {
+    if (smq_send(q, &wrap, timeout_ms) < 0) {
         /* error, free the memory and return -1 */
-        free (p);
+        free (wrap.ptr);
 
         return -1;
     }
-    return retval;
+    return 0;
+}
+
+/*
+** vsmq_set_compression()
+**
+** Compress payloads of at least ``min_size'' bytes as they are sent,
+** with the built in LZ codec (smq_lz.c), and decompress them again in
+** vsmq_recv(). This trades some CPU on both sides for much less memory
+** held by a backlog of large, repetitive (e.g. JSON) messages. Payloads
+** which do not shrink by at least 1/VSMQ_MIN_SAVING are queued as is.
+**
+** Anything taking a vSMQ_WRAP from the queue itself, such as an
+** smq_consume() handler, must call vsmq_unwrap() on it first.
+**
+** @q: The vSMQ object.
+** @min_size: The threshold in bytes, or 0 to stop compressing.
+**
+** Returns 0, or -1 if min_size is negative or q is not a vSMQ.
+*/
+int vsmq_set_compression(vSMQ q, int min_size) {
+    if (min_size < 0 || q->onfree != _vsmq_free)
+        return -1;
+    __atomic_store_n(&((vSMQ_CTL *)q->onfree_ctx)->min_compress, min_size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+** vsmq_unwrap()
+**
+** Decompress a message taken from a vSMQ, if it was compressed, so that
+** ``ptr'' holds ``sz'' plain bytes (plus a terminating NUL) which the
+** caller must free(). vsmq_recv() does this itself.
+**
+** @wrap: The message.
+**
+** Returns 0, or -1 with errno set if it could not be decompressed:
+** ENOMEM when out of memory, EBADMSG when the payload is corrupt. The
+** message is then left as it was.
+*/
+int vsmq_unwrap(vSMQ_WRAP *wrap) {
+    char *p;
+
+    if (!wrap->csz)
+        return 0;
+
+    if (!(p = malloc((size_t)wrap->sz + 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (smq_lz_decompress(wrap->ptr, wrap->csz, p, wrap->sz) != wrap->sz) {
+        free (p);
+        errno = EBADMSG;
+        return -1;
+    }
+    p[wrap->sz] = '\0';
+
+    free (wrap->ptr);
+    wrap->ptr = p;
+    wrap->csz = 0;
+    return 0;
 }
 
 /*
@@ -109,14 +276,31 @@ int vsmq_send(vSMQ q, void *data, int sz, int timeout_ms) {
 **  pointer will still be returned, if available.
 ** @timeout_ms: The timeout to wait for new data to become available.
 **
-** Returns pointer to the data copied to the queue previously.
+** Returns pointer to the data copied to the queue previously. NULL is
+** returned with *sz set to 0 when nothing arrived in time, or with *sz
+** set to -1 when a compressed message was taken but could not be
+** decompressed (errno as for vsmq_unwrap()); that message is lost.
 */
 void *vsmq_recv(vSMQ q, int *sz, int timeout_ms) {
     vSMQ_WRAP wrap;
+    int err;
+
+    if (sz)
+        *sz = 0;
 
     /* No data available */
     if (!(smq_recv(q, &wrap, NULL, timeout_ms)))
         return NULL;
+
+    /* compressed on the way in; a message we cannot restore is lost */
+    if (vsmq_unwrap(&wrap) < 0) {
+        err = errno;
+        free (wrap.ptr);
+        if (sz)
+            *sz = -1;
+        errno = err;
+        return NULL;
+    }
     if (sz)
         *sz = wrap.sz;
     return wrap.ptr;
@@ -125,10 +309,15 @@ void *vsmq_recv(vSMQ q, int *sz, int timeout_ms) {
 /*
 ** vsmq_destroy()
 **
-** Wrapper for smq_destroy()
+** Wrapper for smq_destroy(); also frees the vSMQ control block.
 */
 int vsmq_destroy(vSMQ q) {
-    return smq_destroy(q);
+    void *ctl = q->onfree_ctx;
+    int retval;
+
+    retval = smq_destroy(q);
+    free (ctl);
+    return retval;
 }
 
 /*
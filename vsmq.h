@@ -26,6 +26,7 @@
 ** Original Author: Keith Fralick
 */
 
+#include <sys/uio.h>
 #include "smq.h"
 
 #ifndef __VSMQ_H__
@@ -35,12 +36,28 @@ typedef SMQ vSMQ;
 
 typedef struct st_vsmpq {
     int sz;
+
+    /*
+    ** If not 0, ``ptr'' holds ``csz'' bytes compressed with smq_lz and
+    ** ``sz'' is the size once decompressed; see vsmq_unwrap()
+    */
+    int csz;
     void *ptr;
 } vSMQ_WRAP;
 
+/*
+** Compressed payloads must save at least 1/VSMQ_MIN_SAVING of their
+** size to be kept; otherwise the payload is queued as is.
+*/
+#define VSMQ_MIN_SAVING     8
+
 
 extern vSMQ vsmq_create(int);
+extern vSMQ vsmq_create_combining(int);
 extern int vsmq_send(vSMQ q, void *, int, int);
+extern int vsmq_sendv(vSMQ q, const struct iovec *, int, int);
+extern int vsmq_set_compression(vSMQ, int);
+extern int vsmq_unwrap(vSMQ_WRAP *);
 extern void *vsmq_recv(vSMQ, int *, int);
 extern int vsmq_destroy(vSMQ);
 extern int vsmq_get_count(vSMQ);